@@ -0,0 +1,377 @@
+#include <string.h>
+#include <time.h>
+
+#include <exception>
+#include <vector>
+
+#include "Database.h"
+#include "dthread.h"
+
+using namespace std;
+
+// kinds of ledger record, the first byte of each
+#define RECORD_USER 'U'
+#define RECORD_TRANSFER 'T'
+#define RECORD_DEPOSIT 'D'
+
+static void putInt(string *out, int64_t value) {
+  out->append((const char *) &value, sizeof(value));
+}
+
+static void putString(string *out, const string &value) {
+  putInt(out, value.size());
+  out->append(value);
+}
+
+static int64_t getInt(const string &in, size_t *offset) {
+  int64_t value;
+  if (in.size() - *offset < sizeof(value)) {
+    throw LedgerError("record cut short");
+  }
+  memcpy(&value, in.data() + *offset, sizeof(value));
+  *offset += sizeof(value);
+  return value;
+}
+
+static string getString(const string &in, size_t *offset) {
+  uint64_t len = getInt(in, offset);
+  if (in.size() - *offset < len) {
+    throw LedgerError("record cut short");
+  }
+  string value = in.substr(*offset, len);
+  *offset += len;
+  return value;
+}
+
+static string userRecord(const User &user) {
+  string record(1, RECORD_USER);
+  putString(&record, user.username);
+  putString(&record, user.email);
+  putString(&record, user.password);
+  putString(&record, user.user_id);
+  putInt(&record, user.balance);
+  return record;
+}
+
+static bool sameUser(const User &a, const User &b) {
+  return a.username == b.username && a.email == b.email && a.password == b.password &&
+    a.user_id == b.user_id && a.balance == b.balance;
+}
+
+Database::Database() {
+  for (int idx = 0; idx < DATABASE_SHARDS; idx++) {
+    pthread_mutex_init(&m_shards[idx].lock, NULL);
+    m_shards[idx].sweepAt = 64;
+  }
+  m_ledger = NULL;
+  m_snapshotEvery = 0;
+  m_snapshotting = false;
+  m_tokenEpoch = 0;
+}
+
+uint64_t Database::nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+Database::~Database() {
+  delete m_ledger;
+  for (int idx = 0; idx < DATABASE_SHARDS; idx++) {
+    unordered_map<string, User *>::iterator iter;
+    for (iter = m_shards[idx].users.begin(); iter != m_shards[idx].users.end(); iter++) {
+      delete iter->second;
+    }
+    pthread_mutex_destroy(&m_shards[idx].lock);
+  }
+}
+
+void Database::open(const string &dir, uint64_t snapshotEvery) {
+  Ledger *ledger = new Ledger(dir);
+  try {
+    // nobody else can see us yet, so nothing needs locking
+    ledger->recover([this](const string &record) { replay(record); },
+                    [this](const string &record) { replay(record); });
+  } catch (...) {
+    delete ledger;
+    throw;
+  }
+  m_ledger = ledger;
+  m_snapshotEvery = snapshotEvery;
+}
+
+void Database::replay(const string &record) {
+  size_t offset = 1;
+  if (record.empty()) {
+    throw LedgerError("empty record");
+  }
+
+  if (record[0] == RECORD_USER) {
+    string username = getString(record, &offset);
+    User *user = findUser(username);
+    if (user == NULL) {
+      user = new User();
+      user->username = username;
+      shardFor(username)->users[username] = user;
+    }
+    user->email = getString(record, &offset);
+    user->password = getString(record, &offset);
+    user->user_id = getString(record, &offset);
+    user->balance = getInt(record, &offset);
+  } else if (record[0] == RECORD_TRANSFER) {
+    User *from = findUser(getString(record, &offset));
+    User *to = findUser(getString(record, &offset));
+    int amount = getInt(record, &offset);
+    if (from == NULL || to == NULL) {
+      throw LedgerError("transfer for an unknown user");
+    }
+    from->balance -= amount;
+    to->balance += amount;
+    link(transfers.append(from, to, amount));
+  } else if (record[0] == RECORD_DEPOSIT) {
+    User *to = findUser(getString(record, &offset));
+    int amount = getInt(record, &offset);
+    string charge = getString(record, &offset);
+    if (to == NULL) {
+      throw LedgerError("deposit for an unknown user");
+    }
+    to->balance += amount;
+    deposits.append(to, amount, charge);
+  } else {
+    throw LedgerError("unknown record");
+  }
+}
+
+Database::Shard *Database::shardFor(const string &key) {
+  return &m_shards[hash<string>()(key) % DATABASE_SHARDS];
+}
+
+uint64_t Database::logChange(const string &record) {
+  if (m_ledger == NULL) {
+    return 0;
+  }
+  return m_ledger->append(record);
+}
+
+void Database::commit(uint64_t seq) {
+  if (m_ledger == NULL) {
+    return;
+  }
+  m_ledger->commit(seq);
+  if (m_snapshotEvery > 0 && m_ledger->sinceSnapshot() >= m_snapshotEvery &&
+      !m_snapshotting.exchange(true)) {
+    try {
+      snapshot();
+    } catch (...) {
+      m_snapshotting = false;
+      throw;
+    }
+    m_snapshotting = false;
+  }
+}
+
+void Database::snapshot() {
+  // with every shard locked nothing can change or be logged, so the
+  // copy is exactly the state at the start of the new segment. The
+  // shards are taken in the same order transfer() takes them
+  vector<string> records;
+  for (int idx = 0; idx < DATABASE_SHARDS; idx++) {
+    dthread_mutex_lock(&m_shards[idx].lock);
+  }
+  uint64_t gen = 0;
+  try {
+    for (int idx = 0; idx < DATABASE_SHARDS; idx++) {
+      unordered_map<string, User *>::iterator iter;
+      for (iter = m_shards[idx].users.begin(); iter != m_shards[idx].users.end(); iter++) {
+        records.push_back(userRecord(*iter->second));
+      }
+    }
+    gen = m_ledger->rotate();
+  } catch (...) {
+    for (int idx = DATABASE_SHARDS - 1; idx >= 0; idx--) {
+      dthread_mutex_unlock(&m_shards[idx].lock);
+    }
+    throw;
+  }
+  for (int idx = DATABASE_SHARDS - 1; idx >= 0; idx--) {
+    dthread_mutex_unlock(&m_shards[idx].lock);
+  }
+
+  // writing it out can take a while, and doesn't need the locks
+  m_ledger->writeSnapshot(gen, records);
+}
+
+bool Database::addUser(User *user) {
+  Shard *shard = shardFor(user->username);
+  dthread_mutex_lock(&shard->lock);
+  bool added = shard->users.insert(make_pair(user->username, user)).second;
+  uint64_t seq = added ? logChange(userRecord(*user)) : 0;
+  dthread_mutex_unlock(&shard->lock);
+  if (added) {
+    commit(seq);
+  }
+  return added;
+}
+
+User *Database::findUser(const string &username) {
+  Shard *shard = shardFor(username);
+  dthread_mutex_lock(&shard->lock);
+  unordered_map<string, User *>::iterator iter = shard->users.find(username);
+  User *user = iter == shard->users.end() ? NULL : iter->second;
+  dthread_mutex_unlock(&shard->lock);
+  return user;
+}
+
+void Database::update(User *user, const function<void(User *)> &fn) {
+  Shard *shard = shardFor(user->username);
+  dthread_mutex_lock(&shard->lock);
+  User before = *user;
+  exception_ptr error;
+  try {
+    fn(user);
+  } catch (...) {
+    error = current_exception();
+  }
+  // reads don't need logging, and whatever changed before a throw
+  // still happened
+  bool changed = !sameUser(before, *user);
+  uint64_t seq = changed ? logChange(userRecord(*user)) : 0;
+  dthread_mutex_unlock(&shard->lock);
+
+  if (changed) {
+    commit(seq);
+  }
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+void Database::addToken(const string &token, User *user, int ttlSeconds) {
+  Shard *shard = shardFor(token);
+  uint64_t now = nowUs();
+  dthread_mutex_lock(&shard->lock);
+  if (shard->auth_tokens.size() >= shard->sweepAt) {
+    // tokens nobody uses again never get looked up and dropped, so
+    // clear out the expired ones every time the table doubles
+    unordered_map<string, Token>::iterator iter = shard->auth_tokens.begin();
+    while (iter != shard->auth_tokens.end()) {
+      if (iter->second.expiresUs <= now) {
+        iter = shard->auth_tokens.erase(iter);
+      } else {
+        iter++;
+      }
+    }
+    shard->sweepAt = max((size_t) 64, shard->auth_tokens.size() * 2);
+  }
+  Token entry = {user, now + (uint64_t) ttlSeconds * 1000000};
+  pair<unordered_map<string, Token>::iterator, bool> added =
+    shard->auth_tokens.insert(make_pair(token, entry));
+  if (!added.second) {
+    added.first->second = entry;
+  }
+  dthread_mutex_unlock(&shard->lock);
+  if (!added.second) {
+    // workers may have the old user or expiry cached, the same as for
+    // a removed token
+    m_tokenEpoch.fetch_add(1, memory_order_release);
+  }
+}
+
+User *Database::findToken(const string &token, uint64_t *expiresUs) {
+  Shard *shard = shardFor(token);
+  User *user = NULL;
+  dthread_mutex_lock(&shard->lock);
+  unordered_map<string, Token>::iterator iter = shard->auth_tokens.find(token);
+  if (iter != shard->auth_tokens.end()) {
+    if (iter->second.expiresUs > nowUs()) {
+      user = iter->second.user;
+      if (expiresUs != NULL) {
+        *expiresUs = iter->second.expiresUs;
+      }
+    } else {
+      shard->auth_tokens.erase(iter);
+    }
+  }
+  dthread_mutex_unlock(&shard->lock);
+  return user;
+}
+
+bool Database::removeToken(const string &token) {
+  Shard *shard = shardFor(token);
+  dthread_mutex_lock(&shard->lock);
+  bool removed = shard->auth_tokens.erase(token) > 0;
+  dthread_mutex_unlock(&shard->lock);
+  if (removed) {
+    m_tokenEpoch.fetch_add(1, memory_order_release);
+  }
+  return removed;
+}
+
+void Database::link(Transfer *transfer) {
+  User *users[2] = {transfer->from, transfer->to};
+  int count = transfer->from == transfer->to ? 1 : 2;
+  for (int idx = 0; idx < count; idx++) {
+    User *user = users[idx];
+    Transfer *last = user->lastTransfer;
+    if (last == NULL) {
+      user->firstTransfer = transfer;
+    } else if (last->from == user) {
+      last->nextFrom = transfer;
+    } else {
+      last->nextTo = transfer;
+    }
+    user->lastTransfer = transfer;
+  }
+}
+
+bool Database::transfer(User *from, User *to, int amount) {
+  Shard *first = shardFor(from->username);
+  Shard *second = shardFor(to->username);
+  if (second < first) {
+    swap(first, second);
+  }
+  dthread_mutex_lock(&first->lock);
+  if (second != first) {
+    dthread_mutex_lock(&second->lock);
+  }
+
+  bool enough = from->balance >= amount;
+  uint64_t seq = 0;
+  if (enough) {
+    from->balance -= amount;
+    to->balance += amount;
+    // logged while the balances are still locked, so the logs agree
+    // with them on the order of each user's transfers
+    link(transfers.append(from, to, amount));
+    string record(1, RECORD_TRANSFER);
+    putString(&record, from->username);
+    putString(&record, to->username);
+    putInt(&record, amount);
+    seq = logChange(record);
+  }
+
+  if (second != first) {
+    dthread_mutex_unlock(&second->lock);
+  }
+  dthread_mutex_unlock(&first->lock);
+  if (enough) {
+    // others can see the new balances before this returns, but the
+    // client isn't told it went through until it's on disk
+    commit(seq);
+  }
+  return enough;
+}
+
+void Database::deposit(User *to, int amount, const string &stripe_charge_id) {
+  Shard *shard = shardFor(to->username);
+  dthread_mutex_lock(&shard->lock);
+  to->balance += amount;
+  deposits.append(to, amount, stripe_charge_id);
+  string record(1, RECORD_DEPOSIT);
+  putString(&record, to->username);
+  putInt(&record, amount);
+  putString(&record, stripe_charge_id);
+  uint64_t seq = logChange(record);
+  dthread_mutex_unlock(&shard->lock);
+  commit(seq);
+}
@@ -5,18 +5,54 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 
+#include "ClientError.h"
 #include "HttpUtils.h"
 #include "StringUtils.h"
 
 using namespace std;
 
 #define CONNECT_REPLY "HTTP/1.1 200 Connection Established\r\n\r\n"
+#define READ_SIZE 4096
 
-HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
+RequestLimits HTTPRequest::limits = {
+    30 * 1000,          // idleTimeoutMs
+    10 * 1000,          // headerTimeoutMs
+    30 * 1000,          // bodyTimeoutMs
+    64 * 1024,          // maxHeaderBytes
+    16 * 1024 * 1024,   // maxBodyBytes
+};
+
+static long nowMs()
 {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// deadlines are absolute times from nowMs(), -1 for none
+static long deadlineAfter(int timeoutMs)
+{
+    return timeoutMs < 0 ? -1 : nowMs() + timeoutMs;
+}
+
+static int remainingMs(long deadline)
+{
+    if(deadline < 0) {
+        return -1;
+    }
+    long remaining = deadline - nowMs();
+    return remaining > 0 ? (int) remaining : 0;
+}
+
+HTTPRequest::HTTPRequest(MySocket *sock, int serverPort, Arena *arena)
+    : m_http(HTTP_REQUEST, arena),
+      m_decodedQuery(ArenaAllocator<char>(arena)),
+      m_params(ArenaAllocator< pair<string_view, string_view> >(arena))
+{
+    m_paramsParsed = false;
     m_sock = sock;
-    m_http = new HTTP();
     m_serverPort = serverPort;
     m_totalBytesRead = 0;
     m_totalBytesWritten = 0;
@@ -24,58 +60,87 @@ HTTPRequest::HTTPRequest(MySocket *sock, int serverPort)
 
 HTTPRequest::~HTTPRequest()
 {
-    delete m_http;
 }
 
 void HTTPRequest::printDebugInfo()
 {
-    cerr << "    isDone = " << m_http->isDone() << endl;
+    cerr << "    isDone = " << m_http.isDone() << endl;
     cerr << "    bytesRead = " << m_totalBytesRead << endl;
     cerr << "    bytesWritte = " << m_totalBytesWritten << endl;
-    cerr << "    url = " << m_http->getUrl() << endl;
+    cerr << "    url = " << m_http.getUrl() << endl;
+}
+
+const HTTPRequest::Params &HTTPRequest::getParamPairs() {
+  if (!m_paramsParsed) {
+    string_view query = m_http.getQueryView();
+    Params *params = &m_params;
+    m_decodedQuery.resize(query.size());
+    WwwFormEncodedDict::parse(query.data(), query.size(), &m_decodedQuery[0],
+                              [params](string_view key, string_view value) {
+                                params->push_back(make_pair(key, value));
+                              }, true);
+    m_paramsParsed = true;
+  }
+  return m_params;
+}
+
+bool HTTPRequest::findParam(string_view key, string_view *value) {
+  const Params &params = getParamPairs();
+  for (size_t idx = 0; idx < params.size(); idx++) {
+    if (params[idx].first == key) {
+      *value = params[idx].second;
+      return true;
+    }
+  }
+  return false;
 }
 
 map<string, string> HTTPRequest::getParams() {
-  return HttpUtils::params(m_http->getQuery());
+  map<string, string> paramMap;
+  const Params &params = getParamPairs();
+  for (size_t idx = 0; idx < params.size(); idx++) {
+    paramMap[string(params[idx].first)] = string(params[idx].second);
+  }
+  return paramMap;
 }
 
 WwwFormEncodedDict HTTPRequest::formEncodedBody() {
-  WwwFormEncodedDict dict(m_http->getBody());
+  WwwFormEncodedDict dict(m_http.getBodyView());
   return dict;
 }
 
+bool HTTPRequest::formEncodedPairs(WwwFormEncodedDict::Pairs *pairs) {
+  size_t len = m_http.getBodyView().size();
+  return WwwFormEncodedDict::parse(m_http.getBodyInsitu(), len, m_http.getBodyInsitu(), pairs) >= 0;
+}
+
 string HTTPRequest::getPath() {
-  return m_http->getPath();
+  return m_http.getPath();
 }
 
 string HTTPRequest::getHeader(string key) {
-  vector<pair<string *, string *> >::iterator iter;
-  vector<pair<string *, string *> > headers = m_http->getHeaders();
-  for (iter = headers.begin(); iter != headers.end(); iter++) {
-    string header_key = *(iter->first);
-    if (header_key == key) {
-      return *(iter->second);
-    }
+  string_view value;
+  if (!m_http.findHeader(key, &value)) {
+    throw "could not find header";
   }
+  return string(value);
+}
 
-  throw "could not find header";
+bool HTTPRequest::findHeader(string_view key, string_view *value) {
+  return m_http.findHeader(key, value);
 }
 
 bool HTTPRequest::hasAuthToken() {
-  try {
-    getHeader("x-auth-token");
-    return true;
-  } catch (...) {
-    return false;
-  }
+  string_view token;
+  return m_http.getAuthToken(&token);
 }
 
 string HTTPRequest::getAuthToken() {
-  try {
-    return getHeader("x-auth-token");
-  } catch (...) {
+  string_view token;
+  if (!m_http.getAuthToken(&token)) {
     return "";
   }
+  return string(token);
 }
 
 vector<string> HTTPRequest::getPathComponents() {
@@ -84,13 +149,39 @@ vector<string> HTTPRequest::getPathComponents() {
 
 bool HTTPRequest::readRequest()
 {
-    assert(!m_http->isDone());
+    assert(!m_http.isDone());
+
+    bool idle = true;
+    bool inBody = false;
+    long deadline = deadlineAfter(limits.idleTimeoutMs);
+
+    // read straight into the parser's buffer so the headers can be
+    // handed out as views without copying them
+    while(!m_http.isDone()) {
+        char *buffer = m_http.recvBuffer(READ_SIZE);
+        int len;
+        m_sock->setReadTimeout(remainingMs(deadline));
+        try {
+            len = m_sock->read_bytes(buffer, READ_SIZE);
+        } catch(SocketTimeout &) {
+            if(idle) {
+                // nothing to answer, the caller just closes it
+                throw;
+            }
+            throw ClientError::requestTimeout();
+        }
+	onRead(buffer, len);
 
-    string readData;
-    while(!m_http->isDone()) {
-        readData = m_sock->read();
-	onRead(readData.c_str(), readData.size());
+        if(idle) {
+            idle = false;
+            deadline = deadlineAfter(limits.headerTimeoutMs);
+        }
+        if(!inBody && m_http.isHeaderDone()) {
+            inBody = true;
+            deadline = deadlineAfter(limits.bodyTimeoutMs);
+        }
     }
+    m_sock->setReadTimeout(-1);
 
     return true;
 }
@@ -99,43 +190,57 @@ void HTTPRequest::onRead(const char *buffer, unsigned int len)
 {
     m_totalBytesRead += len;
 
-    unsigned int bytesRead = 0;
     assert(len > 0);
+    assert(!m_http.isDone());
 
-    while(bytesRead < len) {
-        assert(!m_http->isDone());
-        int ret = m_http->addData((const unsigned char *) (buffer + bytesRead), len - bytesRead);
-        assert(ret > 0);
-        bytesRead += ret;
-        
+    // buffer was handed out by recvBuffer, so the parser takes it in place
+    unsigned int bytesRead = m_http.addReceived(len);
+    if(bytesRead < len) {
         // This is a workaround for a parsing bug that sometimes
         // crops up with connect commands.  The parser will think
         // it is done before it reads the last newline of some
         // properly formatted connect requests
-        if(m_http->isDone() && (bytesRead < len)) {
-            if(m_http->isConnect() && ((len-bytesRead) == 1) && (buffer[bytesRead] == '\n')) {
-                break;
-            } else {
-                assert(false);
-            }
+        if(m_http.isDone() && m_http.isConnect() &&
+           ((len-bytesRead) == 1) && (buffer[bytesRead] == '\n')) {
+            return;
+        }
+        // either a parse error or trailing data after the request
+        throw ClientError::badRequest();
+    }
+
+    if(!m_http.isHeaderDone()) {
+        if(m_totalBytesRead > limits.maxHeaderBytes) {
+            throw ClientError::headerFieldsTooLarge();
         }
+        return;
+    }
+    if(m_http.getHeaderLength() > limits.maxHeaderBytes) {
+        throw ClientError::headerFieldsTooLarge();
+    }
+
+    // counting what's still announced lets us refuse an oversized
+    // upload before reading it
+    int64_t expected = m_http.getExpectedBodyBytes();
+    uint64_t bodyBytes = m_http.getBodyLength() + (expected > 0 ? expected : 0);
+    if(bodyBytes > limits.maxBodyBytes) {
+        throw ClientError::payloadTooLarge();
     }
 }
 
 string HTTPRequest::getHost()
 {
-    return m_http->getHost();
+    return m_http.getHost();
 }
 string HTTPRequest::getRequest()
 {
-    return m_http->getProxyRequest();
+    return m_http.getProxyRequest();
 }
 string HTTPRequest::getUrl()
 {
-    return m_http->getUrl();
+    return m_http.getUrl();
 }
 
 bool HTTPRequest::isConnect()
 {
-    return m_http->isConnect();
+    return m_http.isConnect();
 }
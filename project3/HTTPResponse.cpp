@@ -1,13 +1,20 @@
-#include <sstream>
+#include <charconv>
+
+#include <sys/uio.h>
 
 #include "HTTPResponse.h"
 
 using namespace std;
 
+#define DEFAULT_CONTENT_TYPE "text/html; charset=ISO-8859-1"
+#define SERVER_HEADER "Server: Gunrock Web\r\n"
+#define CHUNKED_HEADER "Transfer-Encoding: chunked\r\n"
+// the server closes every connection after one response, and saying
+// so keeps clients from trying to reuse it
+#define CONNECTION_HEADER "Connection: close\r\n"
+
 HTTPResponse::HTTPResponse() {
   this->streaming = false;
-  this->contentType = "text/html; charset=ISO-8859-1";
-  this->headers["Server"] = "Gunrock Web";
   this->status = 200;
 }
 
@@ -16,11 +23,22 @@ void HTTPResponse::withStreaming() {
 }
 
 void HTTPResponse::setHeader(string name, string value) {
-  this->headers[name] = value;
+  if (name == "Content-Type") {
+    setContentType(std::move(value));
+    return;
+  }
+
+  for (size_t idx = 0; idx < headers.size(); idx++) {
+    if (headers[idx].first == name) {
+      headers[idx].second = std::move(value);
+      return;
+    }
+  }
+  headers.push_back(make_pair(std::move(name), std::move(value)));
 }
 
 void HTTPResponse::setBody(string data) {
-  body = data;
+  body = std::move(data);
 }
 
 int HTTPResponse::getStatus() {
@@ -28,41 +46,124 @@ int HTTPResponse::getStatus() {
 }
 
 void HTTPResponse::setContentType(string contentType) {
-  this->contentType = contentType;
+  this->contentType = std::move(contentType);
 }
 
 void HTTPResponse::setStatus(int status) {
   this->status = status;
 }
 
-string HTTPResponse::statusToString() {
+const char *HTTPResponse::statusToString() {
+  switch (status) {
+  case 200: return "OK";
+  case 201: return "Created";
+  case 204: return "No Content";
+  case 301: return "Moved Permanently";
+  case 302: return "Found";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 401: return "Unauthorized";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 408: return "Request Timeout";
+  case 409: return "Conflict";
+  case 413: return "Payload Too Large";
+  case 431: return "Request Header Fields Too Large";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 503: return "Service Unavailable";
+  case 507: return "Insufficient Storage";
+  default: return "Unknown";
+  }
+}
+
+void HTTPResponse::serializeHeaders(string *out) {
+  char num[24];
+  char *end;
+
+  out->clear();
   if (status == 200) {
-    return "OK";
+    // by far the most common status line
+    out->append("HTTP/1.1 200 OK\r\n");
   } else {
-    return "Unknown";
+    out->append("HTTP/1.1 ");
+    end = to_chars(num, num + sizeof(num), status).ptr;
+    out->append(num, end - num);
+    out->push_back(' ');
+    out->append(statusToString());
+    out->append("\r\n");
   }
-}
 
-string HTTPResponse::response() {
-  stringstream out;
-  setHeader("Content-Type", contentType);
+  out->append("Content-Type: ");
+  if (contentType.empty()) {
+    out->append(DEFAULT_CONTENT_TYPE);
+  } else {
+    out->append(contentType);
+  }
+  out->append("\r\n");
+
   if (streaming) {
-    setHeader("Transfer-Encoding", "chunked");
+    out->append(CHUNKED_HEADER);
   } else {
-    stringstream len;
-    len << body.size();
-    setHeader("Content-Length", len.str());
+    out->append("Content-Length: ");
+    end = to_chars(num, num + sizeof(num), body.size()).ptr;
+    out->append(num, end - num);
+    out->append("\r\n");
   }
 
-  out << "HTTP/1.1 " << status << " " << statusToString() << "\r\n";
-  map<string, string>::iterator iter;
-  for(iter = headers.begin(); iter != headers.end(); iter++) {
-    out << iter->first << ": " << iter->second << "\r\n";
+  bool customServer = false;
+  bool customConnection = false;
+  for (size_t idx = 0; idx < headers.size(); idx++) {
+    const string &name = headers[idx].first;
+    if (name == "Content-Length" || name == "Transfer-Encoding") {
+      // always derived from the body above
+      continue;
+    }
+    if (name == "Server") {
+      customServer = true;
+    } else if (name == "Connection") {
+      customConnection = true;
+    }
+    out->append(name);
+    out->append(": ");
+    out->append(headers[idx].second);
+    out->append("\r\n");
+  }
+  if (!customServer) {
+    out->append(SERVER_HEADER);
   }
-  out << "\r\n";
+  if (!customConnection) {
+    out->append(CONNECTION_HEADER);
+  }
+
+  out->append("\r\n");
+}
+
+string HTTPResponse::response() {
+  string out;
+  serializeHeaders(&out);
+  if (body.size() > 0 && !streaming) {
+    out += body;
+  }
+
+  return out;
+}
+
+void HTTPResponse::send(MySocket *client) {
+  // reused across every response this worker sends
+  static thread_local string headerBuffer;
+  struct iovec iov[2];
+  int iovcnt = 1;
+
+  serializeHeaders(&headerBuffer);
+  iov[0].iov_base = (void *) headerBuffer.data();
+  iov[0].iov_len = headerBuffer.size();
   if (body.size() > 0 && !streaming) {
-    out << body;
+    iov[1].iov_base = (void *) body.data();
+    iov[1].iov_len = body.size();
+    iovcnt = 2;
   }
 
-  return out.str();
+  client->writev(iov, iovcnt);
 }
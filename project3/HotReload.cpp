@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <string>
+
+#include "HotReload.h"
+
+using namespace std;
+
+extern char **environ;
+
+// comma separated listening socket fds
+#define LISTEN_FDS_ENV "GUNROCK_LISTEN_FDS"
+// pipe the new process writes a byte to once it's accepting
+#define READY_FD_ENV "GUNROCK_READY_FD"
+
+vector<int> HotReload::inheritedFds() {
+  vector<int> fds;
+  const char *list = getenv(LISTEN_FDS_ENV);
+  if (list == NULL) {
+    return fds;
+  }
+
+  stringstream items(list);
+  string item;
+  while (getline(items, item, ',')) {
+    int fd = atoi(item.c_str());
+    // only take descriptors that really are open
+    if (fd > 2 && fcntl(fd, F_GETFD) != -1) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fds.push_back(fd);
+    }
+  }
+  // so whatever we start later doesn't think it's a reload too
+  unsetenv(LISTEN_FDS_ENV);
+  return fds;
+}
+
+void HotReload::ready() {
+  const char *ready = getenv(READY_FD_ENV);
+  if (ready == NULL) {
+    return;
+  }
+  int fd = atoi(ready);
+  unsetenv(READY_FD_ENV);
+  if (write(fd, "1", 1) < 0) {
+    // the old process is gone, nobody to tell
+  }
+  close(fd);
+}
+
+bool HotReload::reexec(char **argv, const vector<int> &listenFds, int timeoutMs) {
+  int readyPipe[2];
+  if (pipe2(readyPipe, O_CLOEXEC) != 0) {
+    return false;
+  }
+
+  // build the whole environment now: between fork and exec only async
+  // signal safe calls are allowed, and other threads may be running
+  string fdList;
+  for (size_t idx = 0; idx < listenFds.size(); idx++) {
+    fdList += (idx > 0 ? "," : "") + to_string(listenFds[idx]);
+  }
+  vector<string> vars;
+  for (char **var = environ; *var != NULL; var++) {
+    if (strncmp(*var, LISTEN_FDS_ENV "=", strlen(LISTEN_FDS_ENV) + 1) != 0 &&
+        strncmp(*var, READY_FD_ENV "=", strlen(READY_FD_ENV) + 1) != 0) {
+      vars.push_back(*var);
+    }
+  }
+  vars.push_back(string(LISTEN_FDS_ENV "=") + fdList);
+  vars.push_back(string(READY_FD_ENV "=") + to_string(readyPipe[1]));
+  vector<char *> envp;
+  for (size_t idx = 0; idx < vars.size(); idx++) {
+    envp.push_back((char *) vars[idx].c_str());
+  }
+  envp.push_back(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(readyPipe[0]);
+    close(readyPipe[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // the listening sockets and the write end of the pipe survive the
+    // exec. So does the signal mask, and SIGTERM and SIGHUP stay blocked
+    // until the new process is ready to handle them, since one sent to
+    // the group in between would kill it with the default action
+    for (size_t idx = 0; idx < listenFds.size(); idx++) {
+      fcntl(listenFds[idx], F_SETFD, 0);
+    }
+    fcntl(readyPipe[1], F_SETFD, 0);
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGHUP);
+    sigprocmask(SIG_SETMASK, &handled, NULL);
+    execvpe(argv[0], argv, envp.data());
+    _exit(127);
+  }
+
+  close(readyPipe[1]);
+  struct pollfd pfd;
+  pfd.fd = readyPipe[0];
+  pfd.events = POLLIN;
+  int ret;
+  while ((ret = poll(&pfd, 1, timeoutMs)) < 0 && errno == EINTR) {
+  }
+  char byte;
+  // a byte means it's ready; EOF means it died, or exec'd something
+  // that closed the pipe without saying so
+  bool ok = ret > 0 && read(readyPipe[0], &byte, 1) == 1;
+  close(readyPipe[0]);
+
+  if (!ok) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+  return ok;
+}
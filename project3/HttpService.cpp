@@ -5,16 +5,103 @@
 
 #include "HttpService.h"
 #include "ClientError.h"
+#include "JsonResponse.h"
 
 using namespace std;
 
+// tokens each worker remembers, direct mapped by hash
+#define TOKEN_CACHE_SLOTS 64
+
+struct CachedToken {
+  Database *db;
+  string token;
+  User *user;
+  uint64_t expiresUs;
+  // Database::tokenEpoch() when it was looked up
+  uint64_t epoch;
+};
+
+static thread_local CachedToken t_tokenCache[TOKEN_CACHE_SLOTS];
+
 HttpService::HttpService(string pathPrefix) {
   this->m_pathPrefix = pathPrefix;
+  this->m_db = NULL;
 }
 
 User *HttpService::getAuthenticatedUser(HTTPRequest *request)  {
-  // TODO: implement this function
-  return NULL;
+  User *user = findAuthenticatedUser(request);
+  if (user == NULL) {
+    throw ClientError::unauthorized();
+  }
+  return user;
+}
+
+User *HttpService::findAuthenticatedUser(HTTPRequest *request) {
+  string_view token;
+  if (m_db == NULL || !request->getAuthToken(&token) || token.empty()) {
+    return NULL;
+  }
+
+  CachedToken &cached = t_tokenCache[hash<string_view>()(token) % TOKEN_CACHE_SLOTS];
+  // read before the lookup, so a token removed while we look it up
+  // doesn't stay cached
+  uint64_t epoch = m_db->tokenEpoch();
+  if (cached.db == m_db && cached.epoch == epoch && cached.token == token &&
+      cached.expiresUs > Database::nowUs()) {
+    return cached.user;
+  }
+
+  uint64_t expiresUs;
+  User *user = m_db->findToken(string(token), &expiresUs);
+  if (user != NULL) {
+    cached.db = m_db;
+    cached.token.assign(token);
+    cached.user = user;
+    cached.expiresUs = expiresUs;
+    cached.epoch = epoch;
+  }
+  return user;
+}
+
+void HttpService::sendAccount(HTTPResponse *response, User *user) {
+  JsonResponse json(response);
+  JsonWriter &writer = json.writer();
+  writer.StartObject();
+  m_db->read(user, [&](const User *locked) {
+    json.writeKey("email");
+    json.writeString(locked->email);
+    json.writeKey("balance");
+    writer.Int(locked->balance);
+  });
+  writer.EndObject();
+}
+
+void HttpService::sendTransfers(HTTPResponse *response, User *user) {
+  JsonResponse json(response, 1024);
+  JsonWriter &writer = json.writer();
+  writer.StartObject();
+  // the user's own transfers, rather than everyone's, and locked so
+  // the balance agrees with them
+  m_db->read(user, [&](const User *locked) {
+    json.writeKey("balance");
+    writer.Int(locked->balance);
+    json.writeKey("transfers");
+    writer.StartArray();
+    for (Transfer *transfer = locked->firstTransfer; transfer != NULL;
+         transfer = transfer->next(locked)) {
+      // usernames never change, so the other user's needs no lock
+      writer.StartObject();
+      json.writeKey("from");
+      json.writeString(transfer->from->username);
+      json.writeKey("to");
+      json.writeString(transfer->to->username);
+      json.writeKey("amount");
+      writer.Int(transfer->amount);
+      writer.EndObject();
+    }
+    writer.EndArray();
+  });
+  writer.EndObject();
 }
 
 string HttpService::pathPrefix() {
@@ -1,28 +1,17 @@
 #include <assert.h>
 
 #include "HttpUtils.h"
+#include "WwwFormEncodedDict.h"
 
 using namespace std;
 
 map<string, string> HttpUtils::params(string query) {
   map<string, string> paramMap;
-
-  if (query.size() == 0) {
-    return paramMap;
-  }
-
-  vector<string> pairs = split(query, '&');
-  for (unsigned idx = 0; idx < pairs.size(); idx++) {
-    string param = pairs[idx];
-    vector<string> elements = split(param, '=');
-    if (elements.size() != 2) {
-      throw MalformedQueryString(query);
-    }
-
-    // XXX FIXME we need to url decode the strings
-    paramMap[elements[0]] = elements[1];
-  }
-
+  string decoded(query.size(), '\0');
+  WwwFormEncodedDict::parse(query.data(), query.size(), &decoded[0],
+                            [&paramMap](string_view key, string_view value) {
+                              paramMap[string(key)] = string(value);
+                            }, true);
   return paramMap;
 }
 
@@ -30,12 +19,19 @@ void HttpUtils::writeChunk(MySocket *client,
 				      const void *buf, int numBytes) {
 
   char chunkHeader[256];
-  snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
-  client->write(chunkHeader);
+  struct iovec iov[3];
+  int iovcnt = 0;
+
+  int headerLen = snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", numBytes);
+  iov[iovcnt].iov_base = chunkHeader;
+  iov[iovcnt++].iov_len = headerLen;
   if (buf != NULL && numBytes > 0) {
-    client->write(string((const char *) buf, numBytes));
+    iov[iovcnt].iov_base = (void *) buf;
+    iov[iovcnt++].iov_len = numBytes;
   }
-  client->write("\r\n");
+  iov[iovcnt].iov_base = (void *) "\r\n";
+  iov[iovcnt++].iov_len = 2;
+  client->writev(iov, iovcnt);
 }
 
 void HttpUtils::writeLastChunk(MySocket *client) {
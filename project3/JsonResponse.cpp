@@ -0,0 +1,23 @@
+#include "JsonResponse.h"
+
+using namespace std;
+
+#define JSON_CONTENT_TYPE "application/json"
+// enough for the writer's stack at any sane nesting depth, so the pool
+// never needs another chunk
+#define JSON_POOL_BYTES 4096
+
+JsonResponse::JsonResponse(HTTPResponse *response, size_t expectedBytes)
+  : m_stream(response->bodyBuffer()), m_writer(m_stream, pool()) {
+  response->setContentType(JSON_CONTENT_TYPE);
+  response->bodyBuffer()->clear();
+  response->bodyBuffer()->reserve(expectedBytes);
+}
+
+rapidjson::MemoryPoolAllocator<> *JsonResponse::pool() {
+  static thread_local char buffer[JSON_POOL_BYTES] __attribute__((aligned(16)));
+  static thread_local rapidjson::MemoryPoolAllocator<> allocator(buffer, sizeof(buffer));
+  // whatever the last response left behind is ours now
+  allocator.Clear();
+  return &allocator;
+}
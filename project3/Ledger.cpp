@@ -0,0 +1,398 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Ledger.h"
+#include "dthread.h"
+
+using namespace std;
+
+// every record is preceded by its length and CRC32, both 32 bits
+#define FRAME_HEADER 8
+
+static const uint32_t *crcTable() {
+  static uint32_t table[256];
+  static bool made = [] {
+    for (uint32_t idx = 0; idx < 256; idx++) {
+      uint32_t crc = idx;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+      }
+      table[idx] = crc;
+    }
+    return true;
+  }();
+  (void) made;
+  return table;
+}
+
+uint32_t Ledger::crc32(const char *data, size_t len) {
+  const uint32_t *table = crcTable();
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t idx = 0; idx < len; idx++) {
+    crc = table[(crc ^ (unsigned char) data[idx]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+Ledger::Ledger(const string &dir) {
+  m_dir = dir;
+  pthread_mutex_init(&m_lock, NULL);
+  pthread_cond_init(&m_flushed, NULL);
+  m_fd = -1;
+  m_gen = 0;
+  m_appended = 0;
+  m_durable = 0;
+  m_sinceSnapshot = 0;
+  m_flushing = false;
+  m_failed = false;
+
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw LedgerError("can't create " + dir);
+  }
+  // two writers would interleave their segments, so the directory is
+  // ours until we're gone
+  m_lockFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (m_lockFd < 0) {
+    throw LedgerError("can't open " + dir);
+  }
+  if (flock(m_lockFd, LOCK_EX | LOCK_NB) != 0) {
+    close(m_lockFd);
+    throw LedgerError(dir + " is in use by another process");
+  }
+}
+
+Ledger::~Ledger() {
+  if (m_fd >= 0) {
+    if (!m_pending.empty()) {
+      try {
+        writeAll(m_fd, m_pending);
+        fdatasync(m_fd);
+      } catch (const LedgerError &) {
+        // nobody was waiting on these, so nobody was told they're safe
+      }
+    }
+    close(m_fd);
+  }
+  close(m_lockFd);
+  pthread_cond_destroy(&m_flushed);
+  pthread_mutex_destroy(&m_lock);
+}
+
+string Ledger::path(const char *kind, uint64_t gen) {
+  char name[64];
+  snprintf(name, sizeof(name), "/%s.%llu", kind, (unsigned long long) gen);
+  return m_dir + name;
+}
+
+void Ledger::frame(string *out, const string &record) {
+  uint32_t header[2];
+  header[0] = record.size();
+  header[1] = crc32(record.data(), record.size());
+  out->append((const char *) header, FRAME_HEADER);
+  out->append(record);
+}
+
+void Ledger::listFiles(vector<uint64_t> *segments, vector<uint64_t> *snapshots) {
+  DIR *dir = opendir(m_dir.c_str());
+  if (dir == NULL) {
+    throw LedgerError("can't read " + m_dir);
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned long long gen;
+    char rest;
+    if (sscanf(entry->d_name, "ledger.%llu%c", &gen, &rest) == 1) {
+      segments->push_back(gen);
+    } else if (sscanf(entry->d_name, "snapshot.%llu%c", &gen, &rest) == 1) {
+      snapshots->push_back(gen);
+    }
+  }
+  closedir(dir);
+  sort(segments->begin(), segments->end());
+  sort(snapshots->begin(), snapshots->end());
+}
+
+/// Visits the records of `file` up to the first one that's cut short or
+/// fails its checksum. Returns false, with the length of the good part
+/// in `validLength`, if there was one
+bool Ledger::readRecords(const string &file, const Visitor &visit, off_t *validLength) {
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw LedgerError("can't open " + file);
+  }
+  string data;
+  char buf[64 * 1024];
+  ssize_t got;
+  while ((got = read(fd, buf, sizeof(buf))) > 0) {
+    data.append(buf, got);
+  }
+  close(fd);
+  if (got < 0) {
+    throw LedgerError("can't read " + file);
+  }
+
+  size_t offset = 0;
+  while (offset < data.size()) {
+    uint32_t header[2];
+    if (data.size() - offset < FRAME_HEADER) {
+      break;
+    }
+    memcpy(header, data.data() + offset, FRAME_HEADER);
+    if (data.size() - offset - FRAME_HEADER < header[0]) {
+      break;
+    }
+    const char *record = data.data() + offset + FRAME_HEADER;
+    if (crc32(record, header[0]) != header[1]) {
+      break;
+    }
+    visit(string(record, header[0]));
+    offset += FRAME_HEADER + header[0];
+  }
+  *validLength = offset;
+  return offset == data.size();
+}
+
+void Ledger::recover(const Visitor &snapshotRecord, const Visitor &logRecord) {
+  vector<uint64_t> segments;
+  vector<uint64_t> snapshots;
+  listFiles(&segments, &snapshots);
+
+  // the newest snapshot that was finished, which ends in an empty record
+  uint64_t snapshotGen = 0;
+  while (!snapshots.empty()) {
+    vector<string> records;
+    off_t length;
+    readRecords(path("snapshot", snapshots.back()), [&](const string &record) {
+      records.push_back(record);
+    }, &length);
+    if (!records.empty() && records.back().empty()) {
+      records.pop_back();
+      for (size_t idx = 0; idx < records.size(); idx++) {
+        snapshotRecord(records[idx]);
+      }
+      snapshotGen = snapshots.back();
+      break;
+    }
+    snapshots.pop_back();
+  }
+
+  if (snapshotGen == 0 && !segments.empty() && segments[0] != 1) {
+    // the older segments were dropped once snapshots covered them
+    throw LedgerError("no readable snapshot for the segments left in " + m_dir);
+  }
+  for (size_t idx = 0; idx < segments.size(); idx++) {
+    if (segments[idx] < snapshotGen) {
+      continue;
+    }
+    string file = path("ledger", segments[idx]);
+    off_t length;
+    if (readRecords(file, logRecord, &length)) {
+      continue;
+    }
+    if (idx + 1 < segments.size()) {
+      // only the last segment can have been cut off mid write
+      throw LedgerError(file + " is corrupt");
+    }
+    if (truncate(file.c_str(), length) != 0) {
+      throw LedgerError("can't truncate " + file);
+    }
+  }
+
+  uint64_t gen = segments.empty() ? 1 : segments.back();
+  openSegment(max(gen, snapshotGen));
+}
+
+void Ledger::openSegment(uint64_t gen) {
+  string file = path("ledger", gen);
+  int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw LedgerError("can't open " + file);
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+  m_fd = fd;
+  m_gen = gen;
+  // so the new file's name survives a crash too
+  syncDir();
+}
+
+void Ledger::syncDir() {
+  int fd = open(m_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw LedgerError("can't open " + m_dir);
+  }
+  int res = fsync(fd);
+  close(fd);
+  if (res != 0) {
+    throw LedgerError("can't sync " + m_dir);
+  }
+}
+
+void Ledger::writeAll(int fd, const string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t wrote = write(fd, data.data() + done, data.size() - done);
+    if (wrote < 0 && errno == EINTR) {
+      continue;
+    }
+    if (wrote <= 0) {
+      throw LedgerError("write failed");
+    }
+    done += wrote;
+  }
+}
+
+uint64_t Ledger::append(const string &record) {
+  dthread_mutex_lock(&m_lock);
+  frame(&m_pending, record);
+  uint64_t seq = ++m_appended;
+  m_sinceSnapshot++;
+  dthread_mutex_unlock(&m_lock);
+  return seq;
+}
+
+void Ledger::commit(uint64_t seq) {
+  dthread_mutex_lock(&m_lock);
+  while (m_durable < seq && !m_failed) {
+    if (m_flushing) {
+      // someone else's fsync, which may or may not cover us
+      dthread_cond_wait(&m_flushed, &m_lock);
+      continue;
+    }
+
+    // we lead this group: take everything buffered so far, including
+    // what others appended while the last fsync ran
+    m_flushing = true;
+    string batch;
+    batch.swap(m_pending);
+    uint64_t upTo = m_appended;
+    int fd = m_fd;
+    dthread_mutex_unlock(&m_lock);
+
+    bool ok = true;
+    try {
+      writeAll(fd, batch);
+      ok = fdatasync(fd) == 0;
+    } catch (const LedgerError &) {
+      ok = false;
+    }
+
+    dthread_mutex_lock(&m_lock);
+    m_flushing = false;
+    if (ok) {
+      m_durable = upTo;
+    } else {
+      // we can't tell what made it to disk, so nothing after this can
+      // be promised either
+      m_failed = true;
+    }
+    dthread_cond_broadcast(&m_flushed);
+  }
+  bool failed = m_failed;
+  dthread_mutex_unlock(&m_lock);
+  if (failed) {
+    throw LedgerError("sync failed");
+  }
+}
+
+uint64_t Ledger::sinceSnapshot() {
+  dthread_mutex_lock(&m_lock);
+  uint64_t count = m_sinceSnapshot;
+  dthread_mutex_unlock(&m_lock);
+  return count;
+}
+
+uint64_t Ledger::rotate() {
+  dthread_mutex_lock(&m_lock);
+  while (m_flushing) {
+    dthread_cond_wait(&m_flushed, &m_lock);
+  }
+  try {
+    if (m_failed) {
+      throw LedgerError("sync failed");
+    }
+    writeAll(m_fd, m_pending);
+    if (fdatasync(m_fd) != 0) {
+      m_failed = true;
+      throw LedgerError("sync failed");
+    }
+    m_pending.clear();
+    m_durable = m_appended;
+    dthread_cond_broadcast(&m_flushed);
+    openSegment(m_gen + 1);
+  } catch (...) {
+    dthread_mutex_unlock(&m_lock);
+    throw;
+  }
+  m_sinceSnapshot = 0;
+  uint64_t gen = m_gen;
+  dthread_mutex_unlock(&m_lock);
+  return gen;
+}
+
+void Ledger::writeSnapshot(uint64_t gen, const vector<string> &records) {
+  string data;
+  for (size_t idx = 0; idx < records.size(); idx++) {
+    frame(&data, records[idx]);
+  }
+  // an empty record marks the snapshot as complete
+  frame(&data, "");
+
+  string file = path("snapshot", gen);
+  string tmp = file + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw LedgerError("can't open " + tmp);
+  }
+  try {
+    writeAll(fd, data);
+    if (fsync(fd) != 0) {
+      throw LedgerError("can't sync " + tmp);
+    }
+  } catch (...) {
+    close(fd);
+    unlink(tmp.c_str());
+    throw;
+  }
+  close(fd);
+  if (rename(tmp.c_str(), file.c_str()) != 0) {
+    throw LedgerError("can't rename " + tmp);
+  }
+  syncDir();
+
+  // keep the snapshot before this one and the segments since it, in
+  // case this one can't be read back; anything older goes
+  vector<uint64_t> segments;
+  vector<uint64_t> snapshots;
+  listFiles(&segments, &snapshots);
+  uint64_t previous = 0;
+  for (size_t idx = 0; idx < snapshots.size(); idx++) {
+    if (snapshots[idx] < gen) {
+      previous = snapshots[idx];
+    }
+  }
+  if (previous == 0) {
+    // replaying every segment is still the way back
+    return;
+  }
+  for (size_t idx = 0; idx < snapshots.size(); idx++) {
+    if (snapshots[idx] < previous) {
+      unlink(path("snapshot", snapshots[idx]).c_str());
+    }
+  }
+  for (size_t idx = 0; idx < segments.size(); idx++) {
+    if (segments[idx] < previous) {
+      unlink(path("ledger", segments[idx]).c_str());
+    }
+  }
+}
@@ -0,0 +1,372 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "Metrics.h"
+#include "HttpService.h"
+
+using namespace std;
+
+static const char *PHASE_NAMES[] = {"queue", "parse", "service", "write"};
+static const double QUANTILES[] = {0.5, 0.99, 0.999};
+
+Metrics::Metrics(MetricsRegion *region) {
+  m_ownsRegion = region == NULL;
+  if (m_ownsRegion) {
+    // value-initialized, so every counter starts at zero
+    region = new MetricsRegion();
+  }
+  m_region = region;
+}
+
+Metrics::~Metrics() {
+  if (m_ownsRegion) {
+    delete m_region;
+  }
+}
+
+MetricsRegion *Metrics::newSharedRegion() {
+  void *mem = mmap(NULL, sizeof(MetricsRegion), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  return new (mem) MetricsRegion();
+}
+
+uint64_t Metrics::nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static thread_local MetricsRegion *t_region = NULL;
+static thread_local MetricsShard *t_shard = NULL;
+
+// runs in the child of a fork, in the only thread it has
+static void forgetShard() {
+  t_region = NULL;
+  t_shard = NULL;
+}
+
+void Metrics::attach(MetricsRegion *region) {
+  static bool registered = false;
+  if (!registered) {
+    // otherwise the forking thread's child would keep adding to the
+    // parent's shard
+    pthread_atfork(NULL, NULL, forgetShard);
+    registered = true;
+  }
+  if (m_ownsRegion) {
+    delete m_region;
+  }
+  m_region = region;
+  m_ownsRegion = false;
+}
+
+MetricsShard *Metrics::shard() {
+  if (t_region != m_region) {
+    t_shard = &m_region->shards[claimShard()];
+    t_region = m_region;
+  }
+  return t_shard;
+}
+
+uint32_t Metrics::claimShard() {
+  // shards are only claimed when a thread starts recording, so a scan
+  // for one given back by an exited thread is cheap enough
+  uint32_t claimed = min(m_region->nextShard.load(), (uint32_t) METRICS_MAX_SHARDS);
+  pid_t pid = getpid();
+  for (uint32_t idx = 0; idx < claimed; idx++) {
+    // a released shard still holds its process's share of the gauges,
+    // so only that process or, once it's gone, anyone may take it over
+    pid_t owner = m_region->owners[idx].load();
+    if (owner != pid && owner != 0) {
+      continue;
+    }
+    uint8_t expected = 1;
+    if (m_region->released[idx].compare_exchange_strong(expected, 0)) {
+      m_region->owners[idx].store(pid);
+      return idx;
+    }
+  }
+
+  uint32_t idx = m_region->nextShard.fetch_add(1);
+  if (idx >= METRICS_MAX_SHARDS) {
+    idx = METRICS_MAX_SHARDS - 1;
+  }
+  m_region->owners[idx].store(pid);
+  return idx;
+}
+
+void Metrics::releaseShard() {
+  if (t_region != m_region) {
+    return;
+  }
+  uint32_t idx = t_shard - m_region->shards;
+  // the last shard is shared by every thread past the limit
+  if (idx < METRICS_MAX_SHARDS - 1) {
+    m_region->released[idx].store(1);
+  }
+  t_region = NULL;
+  t_shard = NULL;
+}
+
+void Metrics::releaseProcess(pid_t pid) {
+  uint32_t claimed = min(m_region->nextShard.load(), (uint32_t) METRICS_MAX_SHARDS - 1);
+  for (uint32_t idx = 0; idx < claimed; idx++) {
+    MetricsShard *dead = &m_region->shards[idx];
+    // shards its exited threads released count too: a gauge goes up in
+    // one thread's shard and down in another's, so only the sum over
+    // all of the process's shards means anything
+    if (m_region->owners[idx].load() != pid) {
+      continue;
+    }
+    dead->inFlight.store(0, memory_order_relaxed);
+    dead->queued.store(0, memory_order_relaxed);
+    dead->workers.store(0, memory_order_relaxed);
+    // nobody else takes it over until the owner is cleared
+    m_region->released[idx].store(1);
+    m_region->owners[idx].store(0);
+  }
+}
+
+int Metrics::bucketFor(uint64_t us) {
+  const uint64_t subCount = 1 << HISTOGRAM_SUB_BITS;
+  if (us < subCount) {
+    return us;
+  }
+
+  int msb = 63 - __builtin_clzll(us);
+  int shift = msb - HISTOGRAM_SUB_BITS;
+  int bucket = ((shift + 1) << HISTOGRAM_SUB_BITS) + ((us >> shift) & (subCount - 1));
+  if (bucket >= HISTOGRAM_BUCKETS) {
+    bucket = HISTOGRAM_BUCKETS - 1;
+  }
+  return bucket;
+}
+
+uint64_t Metrics::bucketUpperUs(int bucket) {
+  const int subCount = 1 << HISTOGRAM_SUB_BITS;
+  if (bucket < subCount) {
+    return bucket + 1;
+  }
+
+  int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t lower = (uint64_t) (subCount + (bucket & (subCount - 1))) << shift;
+  return lower + (1ULL << shift);
+}
+
+void Metrics::addRoute(HttpService *service) {
+  if (m_routes.size() >= METRICS_MAX_ROUTES) {
+    return;
+  }
+  m_routes.push_back(service);
+  m_routeNames.push_back(service->pathPrefix());
+}
+
+void Metrics::countRequest(HttpService *service, int status) {
+  MetricsShard *local = shard();
+
+  if (status >= 0 && status < METRICS_MAX_STATUS) {
+    add(local->statusCounts[status], 1);
+  }
+
+  size_t route = METRICS_MAX_ROUTES;
+  for (size_t idx = 0; idx < m_routes.size(); idx++) {
+    if (m_routes[idx] == service) {
+      route = idx;
+      break;
+    }
+  }
+  add(local->routeCounts[route], 1);
+}
+
+void Metrics::countShed() {
+  add(shard()->shed, 1);
+}
+
+void Metrics::recordLatency(Phase phase, uint64_t us) {
+  LatencyCounts &counts = shard()->phases[phase];
+  add(counts.buckets[bucketFor(us)], 1);
+  add(counts.count, 1);
+  add(counts.sumUs, us);
+}
+
+void Metrics::addInFlight(int delta) {
+  shard()->inFlight.fetch_add(delta, memory_order_relaxed);
+}
+
+void Metrics::addQueued(int delta) {
+  shard()->queued.fetch_add(delta, memory_order_relaxed);
+}
+
+void Metrics::addWorkers(int delta) {
+  shard()->workers.fetch_add(delta, memory_order_relaxed);
+}
+
+void Metrics::countSpawned() {
+  add(shard()->spawned, 1);
+}
+
+void Metrics::countRetired() {
+  add(shard()->retired, 1);
+}
+
+void Metrics::sumLatency(Phase phase, uint64_t *buckets, uint64_t *count, uint64_t *sumUs) {
+  uint32_t shards = min(m_region->nextShard.load(), (uint32_t) METRICS_MAX_SHARDS);
+
+  *count = 0;
+  *sumUs = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    buckets[bucket] = 0;
+  }
+  for (uint32_t idx = 0; idx < shards; idx++) {
+    LatencyCounts &counts = m_region->shards[idx].phases[phase];
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+      buckets[bucket] += counts.buckets[bucket].load(memory_order_relaxed);
+    }
+    *count += counts.count.load(memory_order_relaxed);
+    *sumUs += counts.sumUs.load(memory_order_relaxed);
+  }
+}
+
+void Metrics::render(string *out) {
+  uint32_t shards = min(m_region->nextShard.load(), (uint32_t) METRICS_MAX_SHARDS);
+  MetricsShard *all = m_region->shards;
+  char line[256];
+
+  out->append("# HELP gunrock_requests_total Requests answered, by status code.\n"
+              "# TYPE gunrock_requests_total counter\n");
+  for (int status = 0; status < METRICS_MAX_STATUS; status++) {
+    uint64_t total = 0;
+    for (uint32_t idx = 0; idx < shards; idx++) {
+      total += all[idx].statusCounts[status].load(memory_order_relaxed);
+    }
+    if (total > 0) {
+      snprintf(line, sizeof(line), "gunrock_requests_total{status=\"%d\"} %llu\n",
+               status, (unsigned long long) total);
+      out->append(line);
+    }
+  }
+
+  out->append("# HELP gunrock_route_requests_total Requests answered, by the service that handled them.\n"
+              "# TYPE gunrock_route_requests_total counter\n");
+  for (size_t route = 0; route <= m_routes.size(); route++) {
+    size_t slot = route < m_routes.size() ? route : METRICS_MAX_ROUTES;
+    const char *name = route < m_routes.size() ? m_routeNames[route].c_str() : "none";
+    uint64_t total = 0;
+    for (uint32_t idx = 0; idx < shards; idx++) {
+      total += all[idx].routeCounts[slot].load(memory_order_relaxed);
+    }
+    snprintf(line, sizeof(line), "gunrock_route_requests_total{route=\"%s\"} %llu\n",
+             name, (unsigned long long) total);
+    out->append(line);
+  }
+
+  uint64_t shed = 0;
+  int64_t inFlight = 0;
+  int64_t queued = 0;
+  int64_t workers = 0;
+  uint64_t spawned = 0;
+  uint64_t retired = 0;
+  for (uint32_t idx = 0; idx < shards; idx++) {
+    shed += all[idx].shed.load(memory_order_relaxed);
+    inFlight += all[idx].inFlight.load(memory_order_relaxed);
+    queued += all[idx].queued.load(memory_order_relaxed);
+    workers += all[idx].workers.load(memory_order_relaxed);
+    spawned += all[idx].spawned.load(memory_order_relaxed);
+    retired += all[idx].retired.load(memory_order_relaxed);
+  }
+  snprintf(line, sizeof(line),
+           "# HELP gunrock_shed_total Connections turned away with a 503.\n"
+           "# TYPE gunrock_shed_total counter\n"
+           "gunrock_shed_total %llu\n", (unsigned long long) shed);
+  out->append(line);
+  snprintf(line, sizeof(line),
+           "# HELP gunrock_in_flight Requests being handled by a worker.\n"
+           "# TYPE gunrock_in_flight gauge\n"
+           "gunrock_in_flight %lld\n", (long long) inFlight);
+  out->append(line);
+  snprintf(line, sizeof(line),
+           "# HELP gunrock_queued Connections waiting in the buffer.\n"
+           "# TYPE gunrock_queued gauge\n"
+           "gunrock_queued %lld\n", (long long) queued);
+  out->append(line);
+  snprintf(line, sizeof(line),
+           "# HELP gunrock_workers Worker threads in the pool.\n"
+           "# TYPE gunrock_workers gauge\n"
+           "gunrock_workers %lld\n", (long long) workers);
+  out->append(line);
+  snprintf(line, sizeof(line),
+           "# HELP gunrock_workers_spawned_total Workers added because connections waited too long.\n"
+           "# TYPE gunrock_workers_spawned_total counter\n"
+           "gunrock_workers_spawned_total %llu\n", (unsigned long long) spawned);
+  out->append(line);
+  snprintf(line, sizeof(line),
+           "# HELP gunrock_workers_retired_total Workers stopped after sitting idle.\n"
+           "# TYPE gunrock_workers_retired_total counter\n"
+           "gunrock_workers_retired_total %llu\n", (unsigned long long) retired);
+  out->append(line);
+
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sumUs;
+
+  out->append("# HELP gunrock_phase_seconds Time requests spend in each phase.\n"
+              "# TYPE gunrock_phase_seconds histogram\n");
+  string quantiles;
+  for (int phase = 0; phase < NUM_PHASES; phase++) {
+    const char *name = PHASE_NAMES[phase];
+    sumLatency((Phase) phase, buckets, &count, &sumUs);
+
+    // the fine buckets line up with powers of two, so report a coarser
+    // power of four scale from 16us to about a minute
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int bits = 4; bits <= 26; bits += 2) {
+      uint64_t bound = 1ULL << bits;
+      while (bucket < HISTOGRAM_BUCKETS && bucketUpperUs(bucket) <= bound) {
+        cumulative += buckets[bucket++];
+      }
+      snprintf(line, sizeof(line), "gunrock_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+               name, bound / 1e6, (unsigned long long) cumulative);
+      out->append(line);
+    }
+    snprintf(line, sizeof(line),
+             "gunrock_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+             "gunrock_phase_seconds_sum{phase=\"%s\"} %g\n"
+             "gunrock_phase_seconds_count{phase=\"%s\"} %llu\n",
+             name, (unsigned long long) count, name, sumUs / 1e6,
+             name, (unsigned long long) count);
+    out->append(line);
+
+    if (count == 0) {
+      continue;
+    }
+    // quantiles come from the fine buckets, reported at their upper
+    // bound
+    for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+      uint64_t rank = (uint64_t) (QUANTILES[q] * count);
+      if (rank == 0) {
+        rank = 1;
+      }
+      uint64_t seen = 0;
+      int found = 0;
+      while (found < HISTOGRAM_BUCKETS - 1 && seen + buckets[found] < rank) {
+        seen += buckets[found++];
+      }
+      snprintf(line, sizeof(line), "gunrock_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %g\n",
+               name, QUANTILES[q], bucketUpperUs(found) / 1e6);
+      quantiles.append(line);
+    }
+  }
+
+  out->append("# HELP gunrock_phase_quantile_seconds Latency quantiles of each phase, within 12.5%.\n"
+              "# TYPE gunrock_phase_quantile_seconds gauge\n");
+  out->append(quantiles);
+}
@@ -0,0 +1,16 @@
+#include <string>
+
+#include "MetricsService.h"
+
+using namespace std;
+
+MetricsService::MetricsService(Metrics *metrics) : HttpService("/metrics") {
+  m_metrics = metrics;
+}
+
+void MetricsService::get(HTTPRequest *request, HTTPResponse *response) {
+  string body;
+  m_metrics->render(&body);
+  response->setContentType("text/plain; version=0.0.4");
+  response->setBody(std::move(body));
+}
@@ -0,0 +1,98 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "Topology.h"
+
+using namespace std;
+
+#define NODE_DIR "/sys/devices/system/node"
+
+Topology::Topology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+
+  vector<int> nodeIds;
+  DIR *dir = opendir(NODE_DIR);
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+        nodeIds.push_back(atoi(entry->d_name + 4));
+      }
+    }
+    closedir(dir);
+  }
+  sort(nodeIds.begin(), nodeIds.end());
+
+  for (size_t idx = 0; idx < nodeIds.size(); idx++) {
+    ifstream file(NODE_DIR "/node" + to_string(nodeIds[idx]) + "/cpulist");
+    string list;
+    getline(file, list);
+
+    vector<int> cpus;
+    vector<int> listed = parseCpuList(list);
+    for (size_t cpu = 0; cpu < listed.size(); cpu++) {
+      if (listed[cpu] < CPU_SETSIZE && CPU_ISSET(listed[cpu], &allowed)) {
+        cpus.push_back(listed[cpu]);
+      }
+    }
+    if (!cpus.empty()) {
+      m_nodes.push_back(cpus);
+    }
+  }
+
+  if (m_nodes.empty()) {
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+    m_nodes.push_back(cpus);
+  }
+}
+
+vector<int> Topology::parseCpuList(const string &list) {
+  vector<int> cpus;
+  stringstream ranges(list);
+  string range;
+
+  while (getline(ranges, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    size_t dash = range.find('-');
+    int first = atoi(range.c_str());
+    int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+static void fillSet(const vector<int> &cpus, cpu_set_t *set) {
+  CPU_ZERO(set);
+  for (size_t idx = 0; idx < cpus.size(); idx++) {
+    if (cpus[idx] >= 0 && cpus[idx] < CPU_SETSIZE) {
+      CPU_SET(cpus[idx], set);
+    }
+  }
+}
+
+bool Topology::setAffinity(pthread_attr_t *attr, const vector<int> &cpus) {
+  cpu_set_t set;
+  fillSet(cpus, &set);
+  return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
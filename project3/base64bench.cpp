@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Base64.h"
+
+using namespace std;
+
+/// Bytes encoded and decoded per run, for each payload size
+size_t TOTAL_BYTES = 64 * 1024 * 1024;
+
+/**
+ * The implementation Base64 replaced, one 6 bit group at a time, kept
+ * to measure against.
+ */
+namespace legacy {
+
+static char charValue(uint8_t bits) {
+  if (bits <= 25) {
+    return 'A' + bits;
+  }
+  if (bits <= 51) {
+    return 'a' + bits - 26;
+  }
+  if (bits <= 61) {
+    return '0' + bits - 52;
+  }
+  if (bits == 62) {
+    return '+';
+  }
+  if (bits == 63) {
+    return '/';
+  }
+  throw "invalid Base64 bit value";
+}
+
+static uint8_t byteValue(char c) {
+  if ((c >= 'A') && (c <= 'Z')) {
+    return c - 'A';
+  }
+  if ((c >= 'a') && (c <= 'z')) {
+    return c - 'a' + 26;
+  }
+  if ((c >= '0') && (c <= '9')) {
+    return c - '0' + 52;
+  }
+  if (c == '+') {
+    return 62;
+  }
+  if (c == '/') {
+    return 63;
+  }
+  if (c == '=') {
+    return 0;
+  }
+  throw "error_invalid_base64_char";
+}
+
+static string encode(const uint8_t *data, int len) {
+  string ret;
+  ret.reserve((len + 3) * 4 / 3);
+  for (int idx = 0; idx < len; idx += 3) {
+    int chunkLen = min(len - idx, 3);
+    unsigned long bits = data[idx] << 16;
+    if (chunkLen > 1) {
+      bits |= data[idx + 1] << 8;
+    }
+    if (chunkLen > 2) {
+      bits |= data[idx + 2];
+    }
+    char chunk[5];
+    chunk[4] = '\0';
+    chunk[0] = charValue((bits >> 18) & 0x3f);
+    chunk[1] = charValue((bits >> 12) & 0x3f);
+    chunk[2] = chunkLen == 1 ? '=' : charValue((bits >> 6) & 0x3f);
+    chunk[3] = chunkLen < 3 ? '=' : charValue(bits & 0x3f);
+    ret += chunk;
+  }
+  return ret;
+}
+
+static uint8_t *decode(string s, int *len) {
+  int size = s.size() / 4 * 3;
+  if (s[s.size() - 1] == '=') {
+    size -= s[s.size() - 2] == '=' ? 2 : 1;
+  }
+  *len = size;
+  uint8_t *bytes = new uint8_t[s.size() / 4 * 3];
+  for (unsigned int idx = 0, byteIdx = 0; idx < s.size(); idx += 4, byteIdx += 3) {
+    uint32_t bits = byteValue(s[idx]) << 18 | byteValue(s[idx + 1]) << 12 |
+      byteValue(s[idx + 2]) << 6 | byteValue(s[idx + 3]);
+    bytes[byteIdx] = bits >> 16;
+    if (s[idx + 2] != '=') {
+      bytes[byteIdx + 1] = bits >> 8;
+    }
+    if (s[idx + 3] != '=') {
+      bytes[byteIdx + 2] = bits;
+    }
+  }
+  return bytes;
+}
+
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// Runs `fn` over enough payloads to make up TOTAL_BYTES and returns MB/s
+template <typename Fn>
+static double throughput(size_t payloadBytes, Fn fn) {
+  size_t runs = max((size_t) 1, TOTAL_BYTES / payloadBytes);
+  double start = now();
+  for (size_t idx = 0; idx < runs; idx++) {
+    fn();
+  }
+  return runs * payloadBytes / (now() - start) / 1e6;
+}
+
+static void usage() {
+  cerr << "usage: base64bench [-m megabytes_per_run] [payload_bytes ...]" << endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  vector<size_t> sizes;
+  for (int idx = 1; idx < argc; idx++) {
+    if (strcmp(argv[idx], "-m") == 0 && idx + 1 < argc) {
+      TOTAL_BYTES = atol(argv[++idx]) * 1024 * 1024;
+    } else if (atol(argv[idx]) > 0) {
+      sizes.push_back(atol(argv[idx]));
+    } else {
+      usage();
+    }
+  }
+  if (sizes.empty()) {
+    // an auth token, a basic auth header, a small and a large payload
+    sizes = {18, 48, 1024, 64 * 1024};
+  }
+
+  const char *isas[] = {"scalar", "ssse3", "avx2"};
+  cout << "MB/s of input   encode / decode" << endl;
+  for (size_t size : sizes) {
+    vector<uint8_t> data(size);
+    for (size_t idx = 0; idx < size; idx++) {
+      data[idx] = rand();
+    }
+    string encoded = legacy::encode(data.data(), size);
+    vector<char> chars(Base64::encodedLength(size));
+    vector<uint8_t> bytes(Base64::decodedLength(encoded.size()));
+
+    cout << size << " bytes" << endl;
+    volatile size_t sink = 0;
+    double encodeRate = throughput(size, [&]() {
+        sink = sink + legacy::encode(data.data(), size).size();
+      });
+    double decodeRate = throughput(size, [&]() {
+        int len;
+        uint8_t *decoded = legacy::decode(encoded, &len);
+        sink = sink + decoded[0];
+        delete [] decoded;
+      });
+    cout << "  " << left << setw(10) << "legacy" << right << fixed << setprecision(0)
+         << setw(8) << encodeRate << " / " << setw(8) << decodeRate << endl;
+
+    for (const char *isa : isas) {
+      if (!Base64::useIsa(isa)) {
+        continue;
+      }
+      // make sure it's measuring something that works
+      size_t written = Base64::encode(data.data(), size, chars.data());
+      ssize_t decoded = Base64::decode(encoded.data(), encoded.size(), bytes.data());
+      if (string(chars.data(), written) != encoded || decoded != (ssize_t) size ||
+          memcmp(bytes.data(), data.data(), size) != 0) {
+        cerr << isa << " doesn't agree with the legacy code" << endl;
+        return 1;
+      }
+
+      encodeRate = throughput(size, [&]() {
+          sink = sink + Base64::encode(data.data(), size, chars.data());
+        });
+      decodeRate = throughput(size, [&]() {
+          sink = sink + Base64::decode(encoded.data(), encoded.size(), bytes.data());
+        });
+      cout << "  " << left << setw(10) << isa << right << setw(8) << encodeRate
+           << " / " << setw(8) << decodeRate << endl;
+    }
+  }
+
+  return 0;
+}
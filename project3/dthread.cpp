@@ -1,66 +1,360 @@
 #include "dthread.h"
+
+// release builds get inline pthread calls from the header instead
+#ifndef DTHREAD_NO_TRACE
+
 #include <iostream>
 #include <string>
-#include <vector>
-#include <sstream>
+#include <atomic>
 
 #include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
-std::vector<pthread_t> thread_list;
+// Logging is asynchronous: every thread formats its lines into its own
+// single-producer ring, and one background writer merges the rings back
+// into the order the lines were logged and writes them out in batches.
+// Workers never take a lock to log.
+
+#define LOG_RING_SLOTS 512
+#define LOG_LINE_SIZE 240
+#define LOG_WRITE_BATCH 64
+
+struct LogRecord {
+  uint64_t seq;
+  uint32_t len;
+  char line[LOG_LINE_SIZE];
+};
+
+struct LogRing {
+  // next slot the owner will fill, only written by the owner
+  std::atomic<uint64_t> head;
+  // next slot the writer will drain, only written by the writer
+  std::atomic<uint64_t> tail;
+  // next slot the writer will queue for writing; runs ahead of tail
+  // until the batch is written out
+  uint64_t cursor;
+  // cleared when the owning thread exits so another thread can take it
+  std::atomic<bool> in_use;
+  int tid;
+  LogRing *next;
+  LogRecord records[LOG_RING_SLOTS];
+};
+
+// releases the calling thread's ring when the thread exits
+struct LogRingOwner {
+  LogRing *ring;
+  ~LogRingOwner() {
+    if (ring != NULL) {
+      ring->in_use.store(false, std::memory_order_release);
+    }
+  }
+};
+
+static std::atomic<LogRing *> log_rings(NULL);
+static std::atomic<uint64_t> log_seq(0);
+static std::atomic<int> log_tids(0);
+static std::atomic<bool> log_running(false);
+static thread_local LogRingOwner log_owner = {NULL};
+
+// the writer sleeps on this when there's nothing to do, producers only
+// touch it when log_writer_idle is set
+static pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+static std::atomic<bool> log_writer_idle(false);
+static std::atomic<bool> log_writer_stop(false);
+// set by the writer once it has written its last line
+static std::atomic<bool> log_writer_done(false);
+static pthread_t log_writer;
+
 int logFd = -1;
 
-void set_log_file(std::string file_name) {
-  logFd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
-  if (logFd < 0) {
-    std::cerr << "Could not open log file: " << file_name << std::endl;
-    exit(1);
+static LogRing *claim_log_ring() {
+  int tid = log_tids.fetch_add(1);
+
+  // reuse a ring left behind by a thread that exited
+  for (LogRing *ring = log_rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+    bool expected = false;
+    if (!ring->in_use.load(std::memory_order_relaxed) &&
+        ring->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+      ring->tid = tid;
+      log_owner.ring = ring;
+      return ring;
+    }
+  }
+
+  LogRing *ring = new LogRing;
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->cursor = 0;
+  ring->in_use.store(true, std::memory_order_relaxed);
+  ring->tid = tid;
+  ring->next = log_rings.load(std::memory_order_relaxed);
+  while (!log_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
+    // ring->next was refreshed by the failed exchange
   }
+  log_owner.ring = ring;
+  return ring;
 }
 
-void sync_print(std::string function, std::string payload) {
-  int ret = pthread_mutex_lock(&print_lock);
-  if (ret != 0) {
-    std::cerr << "pthread lock mutex error!" << std::endl;
-    exit(1);
+static void wake_log_writer() {
+  if (log_writer_idle.load(std::memory_order_acquire) && log_writer_idle.exchange(false)) {
+    pthread_mutex_lock(&log_writer_lock);
+    pthread_cond_signal(&log_writer_cond);
+    pthread_mutex_unlock(&log_writer_lock);
+  }
+}
+
+static void append(char **pos, char *end, const char *str, size_t len) {
+  if (len > (size_t) (end - *pos)) {
+    len = end - *pos;
   }
+  memcpy(*pos, str, len);
+  *pos += len;
+}
 
-  // search through our thread list to find this thread
-  pthread_t self = pthread_self();
-  int tid = -1;
-  for (size_t idx = 0; idx < thread_list.size(); idx++) {
-    if (pthread_equal(self, thread_list[idx])) {
-      tid = idx;
-      break;
+static void log_line(const char *function, size_t functionLen, const char *payload, size_t payloadLen) {
+  if (!log_running.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  LogRing *ring = log_owner.ring;
+  if (ring == NULL) {
+    ring = claim_log_ring();
+  }
+
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  while (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS) {
+    // full, give the writer a chance to catch up
+    if (!log_running.load(std::memory_order_acquire)) {
+      return;
     }
+    wake_log_writer();
+    sched_yield();
   }
 
-  // if we don't find self in our thread list, add it
-  if (tid < 0) {
-    tid = thread_list.size();
-    thread_list.push_back(self);
+  LogRecord *record = &ring->records[head % LOG_RING_SLOTS];
+  char tid[24];
+  int tidLen = snprintf(tid, sizeof(tid), " thread: %d ", ring->tid);
+  char *pos = record->line;
+  char *end = record->line + LOG_LINE_SIZE - 1;
+  append(&pos, end, function, functionLen);
+  append(&pos, end, tid, tidLen);
+  append(&pos, end, payload, payloadLen);
+  *pos++ = '\n';
+  record->len = pos - record->line;
+
+  // the sequence number is what puts the rings back in order, take it
+  // as late as possible so it matches when the event happened
+  record->seq = log_seq.fetch_add(1);
+  ring->head.store(head + 1, std::memory_order_release);
+  wake_log_writer();
+}
+
+static void write_log_batch(struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t ret = writev(logFd, iov, iovcnt);
+    if (ret < 0) {
+      // same as before, a failed write is dropped
+      return;
+    }
+    while (iovcnt > 0 && (size_t) ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
   }
+}
+
+// Writes out every record it can in sequence order. Returns the number
+// of records written.
+static int drain_log_rings(uint64_t *nextSeq, bool stopping) {
+  struct iovec iov[LOG_WRITE_BATCH];
+  int iovcnt = 0;
+  int written = 0;
+
+  while (true) {
+    // find the ring holding the next record
+    LogRing *found = NULL;
+    LogRing *oldest = NULL;
+    uint64_t oldestSeq = UINT64_MAX;
+    for (LogRing *ring = log_rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+      if (ring->cursor == ring->head.load(std::memory_order_acquire)) {
+        continue;
+      }
+      uint64_t seq = ring->records[ring->cursor % LOG_RING_SLOTS].seq;
+      if (seq == *nextSeq) {
+        found = ring;
+        break;
+      }
+      if (seq < oldestSeq) {
+        oldestSeq = seq;
+        oldest = ring;
+      }
+    }
+
+    if (found == NULL && stopping && oldest != NULL) {
+      // whoever holds the missing sequence number is never going to
+      // publish it, don't wait for it
+      found = oldest;
+      *nextSeq = oldestSeq;
+    }
 
-  std::stringstream write_stream;
-  write_stream << function << " thread: " << tid << " " << payload << std::endl;
-  std::string write_buffer = write_stream.str();
-  ret = write(logFd, write_buffer.c_str(), write_buffer.length());
-  if (ret >= 0 && (size_t) ret != write_buffer.length()) {
-    std::cerr << "log file write error, ret = " << ret << " expected " << write_buffer.length() << std::endl;
+    if (found == NULL || iovcnt == LOG_WRITE_BATCH) {
+      if (iovcnt == 0) {
+        return written;
+      }
+      write_log_batch(iov, iovcnt);
+      // hand the written slots back to their producers
+      for (LogRing *ring = log_rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+        ring->tail.store(ring->cursor, std::memory_order_release);
+      }
+      written += iovcnt;
+      iovcnt = 0;
+      continue;
+    }
+
+    LogRecord *record = &found->records[found->cursor % LOG_RING_SLOTS];
+    iov[iovcnt].iov_base = record->line;
+    iov[iovcnt].iov_len = record->len;
+    iovcnt++;
+    found->cursor++;
+    (*nextSeq)++;
+  }
+}
+
+static void *log_writer_routine(void *) {
+  uint64_t nextSeq = 0;
+
+  while (!log_writer_stop.load(std::memory_order_acquire)) {
+    if (drain_log_rings(&nextSeq, false) > 0) {
+      // let a few more lines pile up so the next writev carries more
+      struct timespec pause = {0, 200 * 1000};
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    pthread_mutex_lock(&log_writer_lock);
+    log_writer_idle.store(true, std::memory_order_release);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 50 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    // the timeout covers a producer that published just before we set
+    // idle and so didn't signal
+    pthread_cond_timedwait(&log_writer_cond, &log_writer_lock, &deadline);
+    log_writer_idle.store(false, std::memory_order_release);
+    pthread_mutex_unlock(&log_writer_lock);
+  }
+
+  drain_log_rings(&nextSeq, true);
+  log_writer_done.store(true, std::memory_order_release);
+  return NULL;
+}
+
+void flush_log() {
+  if (!log_running.exchange(false)) {
+    return;
+  }
+  // no lock, signal or join, since the thread we interrupted may hold
+  // the writer's lock; the writer notices within its 50ms wait
+  log_writer_stop.store(true, std::memory_order_release);
+  for (int waited = 0; waited < 1000 && !log_writer_done.load(std::memory_order_acquire); waited++) {
+    struct timespec pause = {0, 1000 * 1000};
+    nanosleep(&pause, NULL);
+  }
+}
+
+static void start_log_writer() {
+  // not a dthread, its own activity shouldn't show up in the log
+  if (pthread_create(&log_writer, NULL, log_writer_routine, NULL) != 0) {
+    std::cerr << "could not start log writer" << std::endl;
     exit(1);
   }
-  ret = pthread_mutex_unlock(&print_lock);
-  if (ret != 0) {
-    std::cerr << "pthread mutex unlock error!" << std::endl;
+  log_running.store(true, std::memory_order_release);
+}
+
+// A fork copies the rings but not the writer, or any thread that was
+// mid-line, so the child throws away what it inherited and stays quiet
+// until restart_log_writer(). The lock is held across the fork so the
+// child doesn't get it locked by a thread that isn't there.
+static void lock_for_fork() {
+  pthread_mutex_lock(&log_writer_lock);
+}
+
+static void unlock_after_fork() {
+  pthread_mutex_unlock(&log_writer_lock);
+}
+
+// runs in the child, in the only thread it has; this is also between
+// fork and exec for a reload, so it only resets memory
+static void reset_after_fork() {
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  log_writer_lock = lock;
+  log_writer_cond = cond;
+  log_running.store(false, std::memory_order_relaxed);
+  log_writer_idle.store(false, std::memory_order_relaxed);
+  log_writer_stop.store(false, std::memory_order_relaxed);
+  log_writer_done.store(false, std::memory_order_relaxed);
+
+  // the parent writes out whatever was queued before the fork
+  for (LogRing *ring = log_rings.load(std::memory_order_relaxed); ring != NULL; ring = ring->next) {
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->cursor = 0;
+    ring->in_use.store(ring == log_owner.ring, std::memory_order_relaxed);
+  }
+  log_seq.store(0, std::memory_order_relaxed);
+}
+
+void set_log_file(std::string file_name) {
+  logFd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (logFd < 0) {
+    std::cerr << "Could not open log file: " << file_name << std::endl;
     exit(1);
   }
+
+  if (log_running.load()) {
+    return;
+  }
+  start_log_writer();
+  atexit(flush_log);
+  pthread_atfork(lock_for_fork, unlock_after_fork, reset_after_fork);
 }
 
-void sync_print_thread(std::string function, pthread_mutex_t *mutex, pthread_cond_t *cond) {
-  std::stringstream payload;
-  payload << " mutex: " << (void *) mutex << " cond: " << (void *) cond;
-  sync_print(function, payload.str());
+void restart_log_writer() {
+  if (logFd < 0 || log_running.load()) {
+    return;
+  }
+  // the file and its offset are shared with the parent, so each
+  // process's batches land whole, one after another
+  start_log_writer();
+}
+
+void sync_print(std::string function, std::string payload) {
+  log_line(function.data(), function.size(), payload.data(), payload.size());
+}
+
+void sync_print_thread(const char *function, pthread_mutex_t *mutex, pthread_cond_t *cond) {
+  // same formatting as streaming the pointers: 0 for NULL, hex otherwise
+  char payload[64];
+  int len = snprintf(payload, sizeof(payload), " mutex: %#lx cond: %#lx",
+                     (unsigned long) mutex, (unsigned long) cond);
+  log_line(function, strlen(function), payload, len);
 }
 
 struct DthreadArgs {
@@ -119,6 +413,15 @@ int dthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
   return ret;
 }
 
+int dthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+			   const struct timespec *abstime) {
+  sync_print_thread("dthread_cond_timedwait_enter", mutex, cond);
+  int ret = pthread_cond_timedwait(cond, mutex, abstime);
+  sync_print_thread("dthread_cond_timedwait_return", mutex, cond);
+
+  return ret;
+}
+
 int dthread_cond_signal(pthread_cond_t *cond) {
   sync_print_thread("dthread_cond_signal_enter", NULL, cond);
   int ret = pthread_cond_signal(cond);
@@ -134,3 +437,5 @@ int dthread_cond_broadcast(pthread_cond_t *cond) {
 
   return ret;
 }
+
+#endif
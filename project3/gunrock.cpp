@@ -3,6 +3,9 @@
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include <iostream>
 #include <memory>
@@ -13,31 +16,89 @@
 #include <array>
 #include <ctime>
 #include <iomanip>
+#include <algorithm>
+#include <atomic>
 
+#include "ClientError.h"
 #include "HTTPRequest.h"
 #include "HTTPResponse.h"
 #include "HttpService.h"
+#include "Router.h"
 #include "HttpUtils.h"
+#include "Arena.h"
+#include "Database.h"
 #include "FileService.h"
+#include "HotReload.h"
+#include "Metrics.h"
+#include "MetricsService.h"
 #include "MySocket.h"
 #include "MyServerSocket.h"
+#include "MySslSocket.h"
+#include "Topology.h"
 #include "dthread.h"
 
 using namespace std;
 
 int PORT = 8080;
+/// Workers to start with, and the fewest the pool shrinks to (`-t`)
 int THREAD_POOL_SIZE = 1;
+/// Most workers the pool may grow to (`-T`); 0 keeps it at `-t`
+int MAX_THREADS = 0;
+/// Add a worker when a connection waited in the buffer longer than this
+/// many milliseconds and no worker is free (`-Q`)
+long TARGET_QUEUE_MS = 10;
+/// Stop a worker above the minimum once it's been idle this many
+/// milliseconds (`-i`)
+long IDLE_TIMEOUT_MS = 10 * 1000;
 int BUFFER_SIZE = 1;
 bool DEBUG = false;
 string BASEDIR = "static";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
+/// Give up on a client that stops reading the response for this long
+int WRITE_TIMEOUT_MS = 30 * 1000;
+/// Answer 503 instead of waiting when the buffer is full (`-r`)
+bool SHED_WHEN_FULL = false;
+/// Answer 503 to new clients once the oldest buffered connection has
+/// waited this long, in milliseconds; 0 turns it off (`-w`)
+long MAX_QUEUE_WAIT_MS = 0;
+/// Where workers may run (`-a`): "none" leaves them to the scheduler,
+/// "node" keeps each on the CPUs of one NUMA node and "core" pins each
+/// to a single CPU
+string AFFINITY = "none";
+/// How long SIGTERM or SIGHUP waits for buffered and in-flight requests
+/// before exiting anyway, in milliseconds (`-D`)
+int DRAIN_TIMEOUT_MS = 30 * 1000;
+/// Serve HTTPS with this certificate chain and key, both PEM (`-c`, `-k`)
+string CERT_FILE = "";
+string KEY_FILE = "";
+/// Serve from this many forked processes, each with its own pool and
+/// buffers, under a supervisor that restarts them (`-P`); 0 serves from
+/// this process alone
+int PROCESSES = 0;
+/// Keep wallet data in a ledger in this directory (`-L`), recovering it
+/// before serving; empty keeps no wallet data
+string LEDGER_DIR = "";
+/// How long SIGHUP waits for the new process to start accepting
+#define RELOAD_TIMEOUT_MS 10000
+/// A worker process is restarted no sooner than this after it last
+/// started, so one that can't start doesn't fork in a tight loop
+#define RESTART_BACKOFF_MS 1000
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-/// Broadcasted when new connection enters buffer
-pthread_cond_t got_conn = PTHREAD_COND_INITIALIZER;
-/// Broadcasted when connection starts being handled
-pthread_cond_t handled_conn = PTHREAD_COND_INITIALIZER;
+/// Seconds we ask shed clients to wait before trying again
+#define RETRY_AFTER "1"
+
+/// Request counts and latencies, served at /metrics
+Metrics metrics;
+
+/// The wallet data every service shares, NULL without a LEDGER_DIR
+Database *database = NULL;
+
+/// Set once we stop accepting; writing to the pipe wakes the acceptors
+atomic<bool> stopping(false);
+int wake_pipe[2];
+/// Acceptors that haven't noticed `stopping` yet
+atomic<int> running_acceptors(0);
 
 /// Debug print `msg`. Does not do anything if `DEBUG` is not set (by `-g` flag)
 void debug(string src, string msg) {
@@ -50,77 +111,121 @@ void debug(string src, string msg) {
   cout << src << ": " << msg << endl;
 }
 
-vector<HttpService *> services;
+Router router;
 
 HttpService *find_service(HTTPRequest *request) {
-   // find a service that is registered for this path prefix
-  for (unsigned int idx = 0; idx < services.size(); idx++) {
-    if (request->getPath().find(services[idx]->pathPrefix()) == 0) {
-      return services[idx];
-    }
-  }
-
-  return NULL;
+  return router.findService(request->getPathView());
 }
 
 
 void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
-  stringstream payload;
+  try {
+    // invoke the service if we found one
+    if (service == NULL) {
+      // not found status
+      response->setStatus(404);
+      return;
+    }
 
-  // invoke the service if we found one
-  if (service == NULL) {
-    // not found status
-    response->setStatus(404);
-  } else if (request->isHead()) {
-    service->head(request, response);
-  } else if (request->isGet()) {
-    service->get(request, response);
-  } else {
-    // The server doesn't know about this method
-    response->setStatus(501);
+    Router::Handler handler = router.findHandler(request->getMethod());
+    if (handler == NULL) {
+      // The server doesn't know about this method
+      response->setStatus(501);
+    } else {
+      (service->*handler)(request, response);
+    }
+  } catch (ClientError &ce) {
+    response->setStatus(ce.status_code);
+  } catch (...) {
+    // reset the response object and return an error
+    response->setBody("");
+    response->setStatus(500);
   }
 }
 
-void handle_request(MySocket *client) {
-  HTTPRequest *request = new HTTPRequest(client, PORT);
-  HTTPResponse *response = new HTTPResponse();
+/// Send `response` as the last thing on `client`, then stop reading
+/// from it. A client that's already gone is ignored
+void send_final_response(MySocket *client, HTTPResponse *response) {
+  response->setHeader("Connection", "close");
+  try {
+    response->send(client);
+    client->drain();
+  } catch (...) {
+    // the client is gone already, nothing to tell it
+  }
+}
+
+/// Handle one connection. `queued_us` is how long it waited in the buffer
+void handle_request(MySocket *client, Arena *arena, uint64_t queued_us) {
+  // both live in the worker's arena and go away with it at the end
+  HTTPRequest *request = arena->create<HTTPRequest>(client, PORT, arena);
+  HTTPResponse *response = arena->create<HTTPResponse>();
   stringstream payload;
+
+  client->setWriteTimeout(WRITE_TIMEOUT_MS);
+  metrics.recordLatency(Metrics::QUEUE, queued_us);
+  uint64_t start = Metrics::nowUs();
   
   // read in the request
   bool readResult = false;
+  int errorStatus = 0;
   try {
-    payload << "client: " << (void *) client;
+    // only the traced build needs the payload strings
+    if (DTHREAD_TRACING) {
+      payload << "client: " << (void *) client;
+    }
     sync_print("read_request_enter", payload.str());
     readResult = request->readRequest();
     sync_print("read_request_return", payload.str());
+  } catch (ClientError &ce) {
+    // too slow, too big or not HTTP; tell the client which
+    errorStatus = ce.status_code;
   } catch (...) {
     // swallow it
   }    
     
+  uint64_t parsed = Metrics::nowUs();
+  metrics.recordLatency(Metrics::PARSE, parsed - start);
+
   if (!readResult) {
     // there was a problem reading in the request, bail
-    delete response;
-    delete request;
+    if (errorStatus != 0) {
+      response->setStatus(errorStatus);
+      send_final_response(client, response);
+      metrics.countRequest(NULL, errorStatus);
+    }
+    arena->reset();
     sync_print("read_request_error", payload.str());
+    client->close();
+    delete client;
     return;
   }
   
   HttpService *service = find_service(request);
   invoke_service_method(service, request, response);
+  uint64_t served = Metrics::nowUs();
+  metrics.recordLatency(Metrics::SERVICE, served - parsed);
 
   // send data back to the client and clean up
   payload.str(""); payload.clear();
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
   cout << payload.str() << endl;
-  client->write(response->response());
+  try {
+    response->send(client);
+  } catch (...) {
+    // the client went away or stopped reading, nothing left to do
+  }
+  metrics.recordLatency(Metrics::WRITE, Metrics::nowUs() - served);
+  metrics.countRequest(service, response->getStatus());
     
-  delete response;
-  delete request;
+  arena->reset();
 
-  payload.str(""); payload.clear();
-  payload << " client: " << (void *) client;
-  sync_print("close_connection", payload.str());
+  if (DTHREAD_TRACING) {
+    payload.str(""); payload.clear();
+    payload << " client: " << (void *) client;
+    sync_print("close_connection", payload.str());
+  }
   client->close();
   delete client;
 }
@@ -153,48 +258,747 @@ class ConnBuf {
     void enqueue(MySocket* socket) {
       if (is_full())
         throw invalid_argument("ConnBuf is full");
-      sockets.push(socket);
+      sockets.push({socket, Metrics::nowUs()});
     }
 
-    /// Return earliest socket inserted and pop it
-    MySocket* dequeue() {
-      MySocket* ret = sockets.front();
+    /// Return earliest socket inserted and pop it. If `waited_us` is
+    /// given it gets how long the socket sat in the buffer
+    MySocket* dequeue(uint64_t *waited_us = NULL) {
+      Entry ret = sockets.front();
       sockets.pop();
-      return ret;
+      if (waited_us != NULL)
+        *waited_us = Metrics::nowUs() - ret.enqueued_us;
+      return ret.socket;
+    }
+
+    /// How long the earliest socket inserted has been waiting, in
+    /// microseconds, or 0 if the buffer is empty
+    uint64_t oldest_wait_us() {
+      if (sockets.empty())
+        return 0;
+      return Metrics::nowUs() - sockets.front().enqueued_us;
     }
   private:
+    struct Entry {
+      MySocket* socket;
+      uint64_t enqueued_us;
+    };
+
     size_t buf_size;
-    queue<MySocket*> sockets;
+    queue<Entry> sockets;
 };
-ConnBuf conn_buf;
 
-/// Start routine of a worker thread
+/// A connection buffer with the acceptor that fills it and the workers
+/// that drain it. When workers are pinned there's one per NUMA node, so
+/// a connection is accepted, buffered and handled without leaving the
+/// node; otherwise there's just the one
+struct NodeQueue {
+  pthread_mutex_t lock;
+  /// Broadcasted when new connection enters buffer
+  pthread_cond_t got_conn;
+  /// Broadcasted when connection starts being handled
+  pthread_cond_t handled_conn;
+  ConnBuf conn_buf;
+  MyServerSocket *server;
+  /// CPUs of the node, empty if nothing is pinned
+  vector<int> cpus;
+  /// The queue's share of the pool; all of these are guarded by `lock`
+  int min_workers;
+  int max_workers;
+  int workers;
+  /// Workers waiting for a connection
+  int idle_workers;
+  /// Workers ever started here, to deal out the node's cores
+  int started;
+};
+vector<NodeQueue *> queues;
+
+/// Whether to turn away the connection just accepted. Call with the
+/// queue's `lock` held
+bool overloaded(NodeQueue *queue) {
+  if (SHED_WHEN_FULL && queue->conn_buf.is_full())
+    return true;
+  if (MAX_QUEUE_WAIT_MS > 0 && queue->conn_buf.oldest_wait_us() > (uint64_t) MAX_QUEUE_WAIT_MS * 1000)
+    return true;
+  return false;
+}
+
+/// How long a shed TLS client gets for the handshake, and then for the
+/// 503, in milliseconds
+#define SHED_TIMEOUT_MS 250
+/// Shed TLS connections that may wait for the shedder; any more are
+/// closed without an answer
+#define SHED_BUFFER 16
+
+/// TLS connections waiting to be shed. They need a handshake before
+/// they can be told 503, which the shedder thread does so that a slow
+/// client holds up other 503s at worst, never accepting
+pthread_mutex_t shed_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t got_shed = PTHREAD_COND_INITIALIZER;
+ConnBuf shed_buf(SHED_BUFFER);
+
+/// Answer `client` with a 503 without reading its request and close it
+void send_shed_response(MySocket* client) {
+  client->setReadTimeout(SHED_TIMEOUT_MS);
+  client->setWriteTimeout(SHED_TIMEOUT_MS);
+
+  HTTPResponse response;
+  response.setStatus(503);
+  response.setHeader("Retry-After", RETRY_AFTER);
+  send_final_response(client, &response);
+  client->close();
+  delete client;
+}
+
+/// Start routine of the shedder, which answers the TLS connections in
+/// `shed_buf` one at a time
+void* shedder(void*) {
+  dthread_mutex_lock(&shed_lock);
+  while (true) {
+    while (shed_buf.is_empty()) {
+      dthread_cond_wait(&got_shed, &shed_lock);
+    }
+    MySocket *client = shed_buf.dequeue();
+    dthread_mutex_unlock(&shed_lock);
+    send_shed_response(client);
+    dthread_mutex_lock(&shed_lock);
+  }
+  return NULL;
+}
+
+/// Turn away `client` without holding up the acceptor that calls this
+void shed_connection(MySocket* client) {
+  metrics.countShed();
+  debug("main", "shedding client " + to_string((long)client));
+
+  if (dynamic_cast<MySslSocket *>(client) == NULL) {
+    // a new connection has room for the 503 in its send buffer, so
+    // this doesn't wait on the client
+    send_shed_response(client);
+    return;
+  }
+
+  dthread_mutex_lock(&shed_lock);
+  bool queued = !shed_buf.is_full();
+  if (queued) {
+    shed_buf.enqueue(client);
+    dthread_cond_signal(&got_shed);
+  }
+  dthread_mutex_unlock(&shed_lock);
+  if (!queued) {
+    // closing with the client's hello unread resets the connection,
+    // which it notices right away
+    client->close();
+    delete client;
+  }
+}
+
+bool spawn_worker(NodeQueue *queue);
+
+/// Add a worker if connections have been waiting longer than the target
+/// and nobody is free to take them. `waited_us` is the longest wait seen.
+/// Call with the queue's `lock` held
+void maybe_grow(NodeQueue *queue, uint64_t waited_us) {
+  if (queue->workers >= queue->max_workers || queue->idle_workers > 0 || queue->conn_buf.is_empty())
+    return;
+  if (waited_us <= (uint64_t) TARGET_QUEUE_MS * 1000)
+    return;
+  if (spawn_worker(queue)) {
+    metrics.countSpawned();
+    debug("main", "grew pool to " + to_string(queue->workers));
+  }
+}
+
+/// The monotonic time `us` microseconds from now, for timed waits on
+/// the queues' `got_conn`
+struct timespec monotonic_after(uint64_t us) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += us / 1000000;
+  deadline.tv_nsec += (us % 1000000) * 1000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  return deadline;
+}
+
+/// Start routine of a queue's pool watcher. Enqueues and dequeues only
+/// check the wait as they happen, so when every worker is stuck on a
+/// slow request and nothing new arrives, this is what notices the
+/// buffered connections going past TARGET_QUEUE_MS and grows the pool
+void* pool_watcher(void* _args) {
+  NodeQueue *queue = (NodeQueue *) _args;
+  uint64_t target_us = (uint64_t) TARGET_QUEUE_MS * 1000;
+
+  dthread_mutex_lock(&queue->lock);
+  while (true) {
+    if (queue->conn_buf.is_empty() || queue->workers >= queue->max_workers) {
+      // enqueues broadcast this
+      dthread_cond_wait(&queue->got_conn, &queue->lock);
+      continue;
+    }
+    uint64_t waited_us = queue->conn_buf.oldest_wait_us();
+    if (waited_us > target_us) {
+      maybe_grow(queue, waited_us);
+      // give whoever was added a whole target to catch up
+      waited_us = 0;
+    }
+    struct timespec deadline = monotonic_after(max(target_us - waited_us, (uint64_t) 1000));
+    dthread_cond_timedwait(&queue->got_conn, &queue->lock, &deadline);
+  }
+  return NULL;
+}
+
+/// Wait for a connection to arrive in `queue`. Returns false if the
+/// worker should retire instead: it sat idle for IDLE_TIMEOUT_MS and the
+/// pool is above its minimum. Call with the queue's `lock` held
+bool wait_for_connection(NodeQueue *queue) {
+  struct timespec deadline = monotonic_after((uint64_t) IDLE_TIMEOUT_MS * 1000);
+
+  queue->idle_workers++;
+  bool got_one = true;
+  while (queue->conn_buf.is_empty()) {
+    if (queue->workers <= queue->min_workers) {
+      dthread_cond_wait(&queue->got_conn, &queue->lock);
+    } else if (dthread_cond_timedwait(&queue->got_conn, &queue->lock, &deadline) == ETIMEDOUT &&
+               queue->conn_buf.is_empty() && queue->workers > queue->min_workers) {
+      got_one = false;
+      break;
+    }
+  }
+  queue->idle_workers--;
+  return got_one;
+}
+
+/// Start routine of a worker thread, serving the NodeQueue it's given
 void* worker(void* _args) {
-  dthread_mutex_lock(&lock);
+  NodeQueue *queue = (NodeQueue *) _args;
+  // request scoped allocations for everything this worker handles.
+  // A pinned worker already runs on its node, so faulting the arena in
+  // now keeps it in that node's memory
+  Arena arena;
+  if (!queue->cpus.empty()) {
+    arena.prefault(1);
+  }
+
+  dthread_mutex_lock(&queue->lock);
   while (true) {
     debug("worker", "waiting for client");
-    while (conn_buf.is_empty()) {
-      dthread_cond_wait(&got_conn, &lock);
+    if (!wait_for_connection(queue)) {
+      break;
     }
-    MySocket* client = conn_buf.dequeue();
+    uint64_t waited_us;
+    MySocket* client = queue->conn_buf.dequeue(&waited_us);
     debug("worker", "handling client " + to_string((long)client));
-    dthread_cond_broadcast(&handled_conn);
+    dthread_cond_broadcast(&queue->handled_conn);
+    // if this one waited too long, the ones behind it probably will too
+    maybe_grow(queue, waited_us);
+
+    dthread_mutex_unlock(&queue->lock);
+    metrics.addQueued(-1);
+    metrics.addInFlight(1);
+    handle_request(client, &arena, waited_us);
+    metrics.addInFlight(-1);
+    dthread_mutex_lock(&queue->lock);
+  }
+
+  queue->workers--;
+  debug("worker", "retiring, pool is down to " + to_string(queue->workers));
+  dthread_mutex_unlock(&queue->lock);
+  metrics.addWorkers(-1);
+  metrics.countRetired();
+  metrics.releaseShard();
+  return NULL;
+}
+
+/// Start routine of an acceptor, feeding the NodeQueue it's given from
+/// that queue's listening socket until we start stopping
+void* acceptor(void* _args) {
+  NodeQueue *queue = (NodeQueue *) _args;
+  MySocket *client;
+
+  dthread_mutex_lock(&queue->lock);
+  while(!stopping) {
+    dthread_mutex_unlock(&queue->lock);
+    sync_print("waiting_to_accept", "");
+    debug("main", "waiting to accept client");
+    client = queue->server->accept(wake_pipe[0]);
+    if (client == NULL) {
+      // woken up to stop
+      dthread_mutex_lock(&queue->lock);
+      break;
+    }
+    sync_print("client_accepted", "");
+    debug("main", "accepted client " + to_string((long)client));
+    dthread_mutex_lock(&queue->lock);
 
-    dthread_mutex_unlock(&lock);
-    handle_request(client);
-    dthread_mutex_lock(&lock);
+    if (overloaded(queue)) {
+      // turning it away now keeps the wait bounded for everyone we did
+      // accept, and the client hears back instead of timing out
+      dthread_mutex_unlock(&queue->lock);
+      shed_connection(client);
+      dthread_mutex_lock(&queue->lock);
+      continue;
+    }
+    while (queue->conn_buf.is_full()) {
+      maybe_grow(queue, queue->conn_buf.oldest_wait_us());
+      dthread_cond_wait(&queue->handled_conn, &queue->lock);
+    }
+    queue->conn_buf.enqueue(client);
+    metrics.addQueued(1);
+    dthread_cond_broadcast(&queue->got_conn);
+    maybe_grow(queue, queue->conn_buf.oldest_wait_us());
   }
-  dthread_mutex_unlock(&lock);
+  dthread_mutex_unlock(&queue->lock);
+  running_acceptors--;
   return NULL;
 }
 
+/// Create one queue per node in `topology`, or a single unpinned one if
+/// `pinned` is false, each with its own listening socket. `inherited`
+/// are sockets already listening, handed down by a reload; queues share
+/// them if there are fewer sockets than queues
+void create_queues(Topology *topology, bool pinned, const vector<int> &inherited) {
+  int num_queues = pinned ? topology->numNodes() : 1;
+  // the buffer is split between the queues, but every queue needs room
+  // for at least one connection
+  int buffer_size = max(1, (BUFFER_SIZE + num_queues - 1) / num_queues);
+
+  // idle workers time out against the monotonic clock
+  pthread_condattr_t monotonic;
+  pthread_condattr_init(&monotonic);
+  pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+
+  for (int node = 0; node < num_queues; node++) {
+    NodeQueue *queue = new NodeQueue();
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->got_conn, &monotonic);
+    pthread_cond_init(&queue->handled_conn, NULL);
+    queue->conn_buf.set_bufsize(buffer_size);
+    // with several queues the kernel spreads connections between their
+    // sockets
+    if (inherited.empty()) {
+      queue->server = new MyServerSocket(PORT, num_queues > 1);
+    } else if (node < (int) inherited.size()) {
+      queue->server = MyServerSocket::fromFd(inherited[node]);
+    } else {
+      queue->server = queues[node % inherited.size()]->server;
+    }
+    if (pinned) {
+      queue->cpus = topology->cpus(node);
+    }
+    // the pool is split between the queues the same way, though every
+    // queue needs a worker
+    queue->min_workers = THREAD_POOL_SIZE / num_queues + (node < THREAD_POOL_SIZE % num_queues ? 1 : 0);
+    queue->min_workers = max(1, queue->min_workers);
+    queue->max_workers = max(queue->min_workers, (MAX_THREADS + num_queues - 1) / num_queues);
+    queue->workers = 0;
+    queue->idle_workers = 0;
+    queue->started = 0;
+    queues.push_back(queue);
+  }
+  pthread_condattr_destroy(&monotonic);
+}
+
+/// Listening sockets of all the queues, each once
+vector<int> listen_fds() {
+  vector<int> fds;
+  for (size_t idx = 0; idx < queues.size(); idx++) {
+    int fd = queues[idx]->server->getFd();
+    if (find(fds.begin(), fds.end(), fd) == fds.end()) {
+      fds.push_back(fd);
+    }
+  }
+  return fds;
+}
+
+/// Stop accepting, then wait for the buffered and in-flight requests to
+/// finish, for at most DRAIN_TIMEOUT_MS. Returns whether they all did
+bool drain() {
+  stopping = true;
+  if (write(wake_pipe[1], "x", 1) < 0) {
+    cerr << "failed to wake the acceptors" << endl;
+  }
+
+  uint64_t deadline = Metrics::nowUs() + (uint64_t) DRAIN_TIMEOUT_MS * 1000;
+  bool closed = false;
+  while (Metrics::nowUs() < deadline) {
+    if (!closed && running_acceptors == 0) {
+      // everything that got past the backlog is ours now; whoever
+      // inherited the sockets keeps their own copies
+      vector<int> fds = listen_fds();
+      for (size_t idx = 0; idx < fds.size(); idx++) {
+        close(fds[idx]);
+      }
+      closed = true;
+    }
+
+    bool idle = closed;
+    for (size_t idx = 0; idx < queues.size() && idle; idx++) {
+      NodeQueue *queue = queues[idx];
+      dthread_mutex_lock(&queue->lock);
+      idle = queue->conn_buf.is_empty() && queue->idle_workers == queue->workers;
+      dthread_mutex_unlock(&queue->lock);
+    }
+    if (idle) {
+      return true;
+    }
+    usleep(10 * 1000);
+  }
+  return false;
+}
+
+/// The CPUs the next worker started for `queue` may run on, empty to
+/// leave it unpinned
+vector<int> worker_cpus(NodeQueue *queue) {
+  if (AFFINITY == "none") {
+    return vector<int>();
+  }
+  if (AFFINITY == "node") {
+    return queue->cpus;
+  }
+  return vector<int>(1, queue->cpus[queue->started % queue->cpus.size()]);
+}
+
+/// Start another worker for `queue`. Workers are detached and leave on
+/// their own when the pool shrinks. Call with the queue's `lock` held,
+/// or before the queue is in use
+bool spawn_worker(NodeQueue *queue) {
+  vector<int> cpus = worker_cpus(queue);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (!cpus.empty() && !Topology::setAffinity(&attr, cpus)) {
+    cerr << "failed to set worker affinity" << endl;
+  }
+  pthread_t thread;
+  int failed = dthread_create(&thread, &attr, &worker, queue);
+  pthread_attr_destroy(&attr);
+  if (failed) {
+    return false;
+  }
+  dthread_detach(thread);
+  debug("main", "Created thread " + to_string(thread));
+
+  queue->started++;
+  queue->workers++;
+  metrics.addWorkers(1);
+  return true;
+}
+
+
+/// Serve until SIGTERM, or until SIGHUP has started a new copy, then
+/// drain and exit. `listen` are sockets already listening, handed down
+/// by a reload or a supervisor; if there are none the queues bind their
+/// own. A `supervised` worker process leaves SIGHUP to its supervisor.
+/// Only returns on failure, with the exit code
+int serve(char *argv[], Topology *topology, const vector<int> &listen, SSL_CTX *tls, bool supervised) {
+  create_queues(topology, AFFINITY != "none", listen);
+  if (tls != NULL) {
+    for (size_t idx = 0; idx < queues.size(); idx++) {
+      queues[idx]->server->setTls(tls);
+    }
+  }
+  if (pipe2(wake_pipe, O_CLOEXEC) != 0) {
+    cerr << "failed to create pipe" << endl;
+    return 1;
+  }
+
+  // SIGTERM and SIGHUP are handled by this thread alone, in the loop at
+  // the end; every thread started from here on inherits the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  if (tls != NULL) {
+    pthread_t thread;
+    if (dthread_create(&thread, NULL, &shedder, NULL) != 0) {
+      cerr << "failed to create thread" << endl;
+      return 1;
+    }
+    dthread_detach(thread);
+  }
+
+  // Requests go to the service with the longest matching path prefix;
+  // for identical prefixes the first one added wins
+  vector<HttpService *> services;
+  services.push_back(new MetricsService(&metrics));
+  services.push_back(new FileService(BASEDIR));
+  for (size_t idx = 0; idx < services.size(); idx++) {
+    services[idx]->m_db = database;
+    router.addService(services[idx]);
+    metrics.addRoute(services[idx]);
+  }
+
+  // Thread pooling: each queue starts with its minimum
+  for (size_t idx = 0; idx < queues.size(); idx++) {
+    NodeQueue *queue = queues[idx];
+    dthread_mutex_lock(&queue->lock);
+    while (queue->workers < queue->min_workers) {
+      if (!spawn_worker(queue)) {
+        cerr << "failed to create thread" << endl;
+        return 1;
+      }
+    }
+    dthread_mutex_unlock(&queue->lock);
+
+    if (queue->max_workers > queue->min_workers) {
+      pthread_t thread;
+      if (dthread_create(&thread, NULL, &pool_watcher, queue) != 0) {
+        cerr << "failed to create thread" << endl;
+        return 1;
+      }
+      dthread_detach(thread);
+    }
+  }
+
+  // An acceptor per queue, on the queue's node
+  for (size_t idx = 0; idx < queues.size(); idx++) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (!queues[idx]->cpus.empty()) {
+      Topology::setAffinity(&attr, queues[idx]->cpus);
+    }
+    running_acceptors++;
+    int failed = dthread_create(&thread, &attr, &acceptor, queues[idx]);
+    pthread_attr_destroy(&attr);
+    if (failed) {
+      cerr << "failed to create thread" << endl;
+      return 1;
+    }
+    dthread_detach(thread);
+  }
+  // if we replaced an older process, it can stop accepting now; a
+  // supervisor does that for its workers
+  if (!supervised) {
+    HotReload::ready();
+  }
+
+  // SIGTERM drains and exits. SIGHUP starts a new copy of the binary on
+  // the same sockets first, so no connection is refused while we switch
+  while (true) {
+    int sig;
+    if (sigwait(&signals, &sig) != 0) {
+      continue;
+    }
+    if (sig == SIGHUP && supervised) {
+      // reloading is the supervisor's job
+      continue;
+    }
+    if (sig == SIGHUP && database != NULL) {
+      // the new process couldn't open the ledger until we'd drained,
+      // and we don't drain until it's ready
+      cerr << "can't reload with a ledger open, still serving" << endl;
+      continue;
+    }
+    if (sig == SIGHUP) {
+      debug("main", "reloading");
+      if (!HotReload::reexec(argv, listen_fds(), RELOAD_TIMEOUT_MS)) {
+        cerr << "reload failed, still serving" << endl;
+        continue;
+      }
+    }
+    break;
+  }
+
+  debug("main", "draining");
+  if (!drain()) {
+    cerr << "gave up waiting for requests after " << DRAIN_TIMEOUT_MS << "ms" << endl;
+  }
+  // the workers are still parked in the pool, so skip the destructors
+  // of everything they share, and atexit with them
+  cout.flush();
+  flush_log();
+  _exit(0);
+}
+
+/// A worker process started by the supervisor
+struct Child {
+  /// -1 while waiting to be restarted
+  pid_t pid;
+  uint64_t started_us;
+  /// when to start it again, if pid is -1
+  uint64_t restart_us;
+};
+vector<Child> children;
+
+/// Fork a worker process that serves `listen`. Returns its pid, or -1
+pid_t start_child(char *argv[], Topology *topology, const vector<int> &listen, SSL_CTX *tls) {
+  pid_t supervisor = getpid();
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  // a supervisor that goes away takes its workers with it, after they
+  // drain
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != supervisor) {
+    _exit(0);
+  }
+  restart_log_writer();
+  int status = serve(argv, topology, listen, tls, true);
+  flush_log();
+  _exit(status);
+}
+
+/// Reap worker processes that exited and start new ones in their place
+/// once they are due, RESTART_BACKOFF_MS after they last started or
+/// failed to fork
+void restart_children(char *argv[], Topology *topology, const vector<int> &listen, SSL_CTX *tls) {
+  pid_t pid;
+  int status;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    size_t idx = 0;
+    while (idx < children.size() && children[idx].pid != pid) {
+      idx++;
+    }
+    if (idx == children.size()) {
+      continue;
+    }
+    metrics.releaseProcess(pid);
+    if (WIFSIGNALED(status)) {
+      cerr << "worker process " << pid << " killed by signal " << WTERMSIG(status) << endl;
+    } else {
+      cerr << "worker process " << pid << " exited with status " << WEXITSTATUS(status) << endl;
+    }
+    children[idx].pid = -1;
+    children[idx].restart_us = children[idx].started_us + (uint64_t) RESTART_BACKOFF_MS * 1000;
+  }
+
+  uint64_t now = Metrics::nowUs();
+  for (size_t idx = 0; idx < children.size(); idx++) {
+    if (children[idx].pid >= 0 || children[idx].restart_us > now) {
+      continue;
+    }
+    children[idx].pid = start_child(argv, topology, listen, tls);
+    children[idx].started_us = now;
+    if (children[idx].pid < 0) {
+      cerr << "failed to restart worker process" << endl;
+      children[idx].restart_us = now + (uint64_t) RESTART_BACKOFF_MS * 1000;
+    }
+  }
+}
+
+/// Microseconds until the next worker process is due to be restarted,
+/// or false if none is waiting
+bool next_restart(uint64_t *wait_us) {
+  bool waiting = false;
+  uint64_t now = Metrics::nowUs();
+  for (size_t idx = 0; idx < children.size(); idx++) {
+    if (children[idx].pid >= 0) {
+      continue;
+    }
+    uint64_t until = children[idx].restart_us > now ? children[idx].restart_us - now : 0;
+    if (!waiting || until < *wait_us) {
+      *wait_us = until;
+    }
+    waiting = true;
+  }
+  return waiting;
+}
+
+/// Bind the sockets once, fork PROCESSES workers onto them and keep that
+/// many running. Every worker counts into the same shared metrics, so
+/// any of them can answer /metrics for all of them. SIGTERM and SIGHUP
+/// work as they do for a single process, with each worker draining its
+/// own requests. Only returns on failure, with the exit code
+int supervise(char *argv[], Topology *topology, SSL_CTX *tls) {
+  vector<int> listen = HotReload::inheritedFds();
+  if (listen.empty()) {
+    int num_queues = AFFINITY != "none" ? topology->numNodes() : 1;
+    for (int idx = 0; idx < num_queues; idx++) {
+      listen.push_back((new MyServerSocket(PORT, num_queues > 1))->getFd());
+    }
+  }
+
+  MetricsRegion *region = Metrics::newSharedRegion();
+  if (region == NULL) {
+    cerr << "failed to map shared memory for metrics" << endl;
+    return 1;
+  }
+  metrics.attach(region);
+
+  // the workers start with these blocked too, and wait for their own
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // the sockets are listening, so whatever arrives before the workers
+  // are accepting waits in the backlog. Saying so before forking also
+  // keeps the workers from holding the reload pipe open
+  HotReload::ready();
+  for (int idx = 0; idx < PROCESSES; idx++) {
+    Child child;
+    child.pid = start_child(argv, topology, listen, tls);
+    child.started_us = Metrics::nowUs();
+    child.restart_us = 0;
+    if (child.pid < 0) {
+      cerr << "failed to start worker process" << endl;
+      return 1;
+    }
+    children.push_back(child);
+  }
+
+  while (true) {
+    // a worker waiting out its backoff gets no SIGCHLD to wake us, so
+    // only wait for a signal until it is due
+    int sig;
+    uint64_t wait_us;
+    if (next_restart(&wait_us)) {
+      struct timespec timeout;
+      timeout.tv_sec = wait_us / 1000000;
+      timeout.tv_nsec = (wait_us % 1000000) * 1000;
+      sig = sigtimedwait(&signals, NULL, &timeout);
+      if (sig < 0) {
+        if (errno == EAGAIN) {
+          restart_children(argv, topology, listen, tls);
+        }
+        continue;
+      }
+    } else if (sigwait(&signals, &sig) != 0) {
+      continue;
+    }
+    if (sig == SIGCHLD) {
+      restart_children(argv, topology, listen, tls);
+      continue;
+    }
+    if (sig == SIGHUP) {
+      debug("main", "reloading");
+      if (!HotReload::reexec(argv, listen, RELOAD_TIMEOUT_MS)) {
+        cerr << "reload failed, still serving" << endl;
+        continue;
+      }
+    }
+    break;
+  }
+
+  debug("main", "draining worker processes");
+  for (size_t idx = 0; idx < children.size(); idx++) {
+    if (children[idx].pid > 0) {
+      kill(children[idx].pid, SIGTERM);
+    }
+  }
+  for (size_t idx = 0; idx < children.size(); idx++) {
+    while (children[idx].pid > 0 && waitpid(children[idx].pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+  }
+  cout.flush();
+  flush_log();
+  _exit(0);
+}
 
 int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:g")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:T:Q:i:b:s:l:grw:I:H:B:W:m:M:a:D:c:k:P:L:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -205,62 +1009,127 @@ int main(int argc, char *argv[]) {
     case 't':
       THREAD_POOL_SIZE = atoi(optarg);
       break;
+    case 'T':
+      MAX_THREADS = atoi(optarg);
+      break;
+    case 'Q':
+      TARGET_QUEUE_MS = atol(optarg);
+      break;
+    case 'i':
+      IDLE_TIMEOUT_MS = atol(optarg);
+      break;
     case 'b':
       BUFFER_SIZE = atoi(optarg);
       break;
     case 's':
       SCHEDALG = string(optarg);
       break;
+    case 'I':
+      HTTPRequest::limits.idleTimeoutMs = atoi(optarg);
+      break;
+    case 'H':
+      HTTPRequest::limits.headerTimeoutMs = atoi(optarg);
+      break;
+    case 'B':
+      HTTPRequest::limits.bodyTimeoutMs = atoi(optarg);
+      break;
+    case 'W':
+      WRITE_TIMEOUT_MS = atoi(optarg);
+      break;
+    case 'm':
+      HTTPRequest::limits.maxHeaderBytes = atol(optarg);
+      break;
+    case 'M':
+      HTTPRequest::limits.maxBodyBytes = atol(optarg);
+      break;
     case 'l':
       LOGFILE = string(optarg);
       break;
     case 'g':
       DEBUG = true;
       break;
+    case 'r':
+      SHED_WHEN_FULL = true;
+      break;
+    case 'w':
+      MAX_QUEUE_WAIT_MS = atol(optarg);
+      break;
+    case 'a':
+      AFFINITY = string(optarg);
+      break;
+    case 'D':
+      DRAIN_TIMEOUT_MS = atoi(optarg);
+      break;
+    case 'c':
+      CERT_FILE = string(optarg);
+      break;
+    case 'k':
+      KEY_FILE = string(optarg);
+      break;
+    case 'P':
+      PROCESSES = atoi(optarg);
+      break;
+    case 'L':
+      LEDGER_DIR = string(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-T max_threads] [-Q target_queue_ms] [-i idle_ms] [-b buffers] [-r] [-w max_queue_ms] [-a none|node|core] [-D drain_ms] [-c cert_file -k key_file] [-P processes] [-L ledger_dir]"
+          << " [-I idle_ms] [-H header_ms] [-B body_ms] [-W write_ms] [-m max_header_bytes] [-M max_body_bytes]" << endl;
       exit(1);
     }
   }
+  if (THREAD_POOL_SIZE < 1) {
+    cerr << "need at least one thread" << endl;
+    exit(1);
+  }
+  if (MAX_THREADS < THREAD_POOL_SIZE) {
+    MAX_THREADS = THREAD_POOL_SIZE;
+  }
+  if (AFFINITY != "none" && AFFINITY != "node" && AFFINITY != "core") {
+    cerr << "unknown affinity " << AFFINITY << ", expected none, node or core" << endl;
+    exit(1);
+  }
 
-  set_log_file(LOGFILE);
+  if (CERT_FILE.empty() != KEY_FILE.empty()) {
+    cerr << "HTTPS needs both a certificate (-c) and a key (-k)" << endl;
+    exit(1);
+  }
 
-  sync_print("init", "");
-  MyServerSocket *server = new MyServerSocket(PORT);
-  MySocket *client;
+  if (!LEDGER_DIR.empty() && PROCESSES > 0) {
+    cerr << "a ledger (-L) can only be kept by a single process, not with -P" << endl;
+    exit(1);
+  }
 
-  // The order that you push services dictates the search order
-  // for path prefix matching
-  services.push_back(new FileService(BASEDIR));
+  set_log_file(LOGFILE);
 
-  // Thread pooling
-  unique_ptr<pthread_t[]> thread_pool(new pthread_t[THREAD_POOL_SIZE]);
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-    if (dthread_create(&thread_pool[i], NULL, &worker, NULL)) {
-      cerr << "failed to create thread" << endl;
+  sync_print("init", "");
+  Topology topology;
+  SSL_CTX *tls = NULL;
+  if (!CERT_FILE.empty()) {
+    // one context for every socket and worker, so a session any of them
+    // handed out can be resumed on any other. Worker processes get a
+    // copy, ticket keys included
+    try {
+      tls = MySslSocket::newServerContext(CERT_FILE, KEY_FILE);
+    } catch (const SocketError &e) {
+      cerr << e.what() << endl;
       return 1;
     }
-    debug("main", "Created thread " + to_string(thread_pool[i]));
   }
 
-  // Buffer
-  conn_buf.set_bufsize(BUFFER_SIZE);
-
-  dthread_mutex_lock(&lock);
-  while(true) {
-    dthread_mutex_unlock(&lock);
-    sync_print("waiting_to_accept", "");
-    debug("main", "waiting to accept client");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    debug("main", "accepted client " + to_string((long)client));
-    dthread_mutex_lock(&lock);
-
-    while (conn_buf.is_full()) {
-      dthread_cond_wait(&handled_conn, &lock);
+  if (!LEDGER_DIR.empty()) {
+    // everything in the ledger is back before the first request
+    database = new Database();
+    try {
+      database->open(LEDGER_DIR);
+    } catch (const LedgerError &e) {
+      cerr << e.what() << endl;
+      return 1;
     }
-    conn_buf.enqueue(client);
-    dthread_cond_broadcast(&got_conn);
   }
-  dthread_mutex_unlock(&lock);
+
+  if (PROCESSES > 0) {
+    return supervise(argv, &topology, tls);
+  }
+  return serve(argv, &topology, HotReload::inheritedFds(), tls, false);
 }
@@ -0,0 +1,141 @@
+#ifndef _APPENDLOG_H_
+#define _APPENDLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <new>
+#include <utility>
+
+/**
+ * An append-only log that any number of threads can add to and read at
+ * once without locking.
+ *
+ * Entries live in chunks that double in size, so an entry never moves
+ * once it's written and pointers to it stay good for the life of the
+ * log. A writer claims the next slot with one atomic add and publishes
+ * the entry after constructing it; readers see every entry up to the
+ * first one still being written.
+ */
+template <typename T>
+class AppendLog {
+ public:
+  AppendLog() : m_claimed(0) {
+    for (int idx = 0; idx < MAX_CHUNKS; idx++) {
+      m_chunks[idx].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  ~AppendLog() {
+    for (int idx = 0; idx < MAX_CHUNKS; idx++) {
+      Chunk *chunk = m_chunks[idx].load(std::memory_order_relaxed);
+      if (chunk == NULL) {
+        continue;
+      }
+      for (size_t slot = 0; slot < chunk->size; slot++) {
+        if (chunk->ready[slot].load(std::memory_order_relaxed)) {
+          chunk->entries[slot].~T();
+        }
+      }
+      freeChunk(chunk);
+    }
+  }
+
+  AppendLog(const AppendLog &) = delete;
+  AppendLog &operator=(const AppendLog &) = delete;
+
+  /**
+   * Adds an entry made from `args` and returns it.
+   */
+  template <typename... Args>
+  T *append(Args&&... args) {
+    uint64_t idx = m_claimed.fetch_add(1, std::memory_order_relaxed);
+    size_t slot;
+    Chunk *chunk = chunkFor(idx, &slot, true);
+    T *entry = new (&chunk->entries[slot]) T(std::forward<Args>(args)...);
+    chunk->ready[slot].store(true, std::memory_order_release);
+    return entry;
+  }
+
+  /**
+   * Calls `fn` on each entry in the order they were added, stopping at
+   * the first one that isn't finished yet. `fn` returns false to stop
+   * early.
+   */
+  template <typename Fn>
+  void forEach(Fn fn) const {
+    uint64_t claimed = m_claimed.load(std::memory_order_acquire);
+    for (uint64_t idx = 0; idx < claimed; idx++) {
+      size_t slot;
+      Chunk *chunk = chunkFor(idx, &slot, false);
+      if (chunk == NULL || !chunk->ready[slot].load(std::memory_order_acquire)) {
+        return;
+      }
+      if (!fn(chunk->entries[slot])) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * Entries claimed so far, including ones still being written.
+   */
+  uint64_t size() const { return m_claimed.load(std::memory_order_acquire); }
+
+ private:
+  // the first chunk holds FIRST_CHUNK entries and each one after it
+  // twice as many as the last, which is room for about 2^42 entries
+  static const size_t FIRST_CHUNK = 1024;
+  static const int MAX_CHUNKS = 32;
+
+  struct Chunk {
+    size_t size;
+    T *entries;
+    std::atomic<bool> *ready;
+  };
+
+  static Chunk *newChunk(size_t size) {
+    Chunk *chunk = new Chunk();
+    chunk->size = size;
+    chunk->entries = (T *) ::operator new(size * sizeof(T), std::align_val_t(alignof(T)));
+    chunk->ready = new std::atomic<bool>[size];
+    for (size_t slot = 0; slot < size; slot++) {
+      chunk->ready[slot].store(false, std::memory_order_relaxed);
+    }
+    return chunk;
+  }
+
+  static void freeChunk(Chunk *chunk) {
+    ::operator delete(chunk->entries, std::align_val_t(alignof(T)));
+    delete[] chunk->ready;
+    delete chunk;
+  }
+
+  /**
+   * Finds the chunk holding entry `idx` and its slot in it. Writers
+   * make the chunk if nobody has yet; if two race, one of them throws
+   * theirs away.
+   */
+  Chunk *chunkFor(uint64_t idx, size_t *slot, bool create) const {
+    uint64_t scaled = idx / FIRST_CHUNK + 1;
+    int chunkIdx = 63 - __builtin_clzll(scaled);
+    *slot = idx - ((((uint64_t) 1 << chunkIdx) - 1) * FIRST_CHUNK);
+
+    Chunk *chunk = m_chunks[chunkIdx].load(std::memory_order_acquire);
+    if (chunk != NULL || !create) {
+      return chunk;
+    }
+    Chunk *made = newChunk(FIRST_CHUNK << chunkIdx);
+    if (m_chunks[chunkIdx].compare_exchange_strong(chunk, made, std::memory_order_acq_rel)) {
+      return made;
+    }
+    freeChunk(made);
+    return chunk;
+  }
+
+  std::atomic<uint64_t> m_claimed;
+  mutable std::atomic<Chunk *> m_chunks[MAX_CHUNKS];
+};
+
+#endif
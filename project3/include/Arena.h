@@ -0,0 +1,135 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * A bump allocator for objects that all die at the same time.
+ *
+ * Each worker thread owns one arena. Everything allocated while
+ * handling a request comes out of it, and reset() releases all of it
+ * in one step once the response has been sent. Blocks are kept
+ * between resets, so a warmed up arena doesn't call malloc at all and
+ * workers never contend on the shared heap.
+ *
+ * Arenas are not thread safe; never share one between threads.
+ */
+class Arena {
+ public:
+  Arena(size_t blockSize = 64 * 1024);
+  ~Arena();
+
+  void *allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+  /**
+   * Constructs a T inside the arena. If T has a destructor it is run
+   * by the next reset().
+   */
+  template <typename T, typename... Args>
+  T *create(Args&&... args) {
+    T *obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+      addFinalizer(&destroy<T>, obj);
+    }
+    return obj;
+  }
+
+  /**
+   * Allocates `blocks` blocks up front and touches every page, so the
+   * memory comes from the NUMA node of the calling thread rather than
+   * wherever the first request happens to run. Capped at the number of
+   * blocks reset() keeps.
+   */
+  void prefault(int blocks);
+
+  /**
+   * Destroys everything made with create(), newest first, and makes
+   * all of the memory available again.
+   */
+  void reset();
+
+ private:
+  struct Block {
+    Block *next;
+    size_t size;
+  };
+
+  struct Finalizer {
+    void (*fn)(void *);
+    void *obj;
+    Finalizer *next;
+  };
+
+  template <typename T>
+  static void destroy(void *obj) {
+    ((T *) obj)->~T();
+  }
+
+  void addFinalizer(void (*fn)(void *), void *obj);
+  void *allocateSlow(size_t size, size_t align);
+  static char *blockData(Block *block) { return (char *) (block + 1); }
+
+  size_t m_blockSize;
+  // blocks in use, newest first; m_free holds blocks kept from earlier
+  // requests
+  Block *m_blocks;
+  Block *m_free;
+  char *m_ptr;
+  char *m_end;
+  Finalizer *m_finalizers;
+};
+
+/**
+ * std allocator that draws from an Arena. Deallocation is a no-op,
+ * the memory comes back on Arena::reset(). With a NULL arena it falls
+ * back to the global heap, so containers using it work either way.
+ */
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  ArenaAllocator(Arena *arena = NULL) : m_arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : m_arena(other.arena()) {}
+
+  T *allocate(size_t n) {
+    if (m_arena == NULL) {
+      return (T *) ::operator new(n * sizeof(T));
+    }
+    return (T *) m_arena->allocate(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T *ptr, size_t /*n*/) {
+    if (m_arena == NULL) {
+      ::operator delete(ptr);
+    }
+  }
+
+  Arena *arena() const { return m_arena; }
+
+ private:
+  Arena *m_arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() != b.arena();
+}
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
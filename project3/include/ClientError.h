@@ -16,6 +16,9 @@ class ClientError : public std::runtime_error {
   static ClientError forbidden() { return ClientError("Forbidden", 403); }
   static ClientError notFound() { return ClientError("Not Found", 404); }
   static ClientError methodNotAllowed() { return ClientError("Method Not Allowed", 405); }
+  static ClientError requestTimeout() { return ClientError("Request Timeout", 408); }
+  static ClientError payloadTooLarge() { return ClientError("Payload Too Large", 413); }
+  static ClientError headerFieldsTooLarge() { return ClientError("Request Header Fields Too Large", 431); }
 };
 
 #endif
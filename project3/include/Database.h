@@ -1,9 +1,26 @@
 #ifndef _DATABASE_H_
 #define _DATABASE_H_
 
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
 #include <string>
-#include <map>
-#include <vector>
+#include <unordered_map>
+
+#include "AppendLog.h"
+#include "Ledger.h"
+#include "dthread.h"
+
+// users and tokens are spread over this many independently locked
+// shards
+#define DATABASE_SHARDS 64
+
+// how long an auth token is good for unless addToken says otherwise
+#define DEFAULT_TOKEN_TTL_SECONDS (24 * 60 * 60)
+
+class Transfer;
 
 class User {
  public:
@@ -12,37 +29,180 @@ class User {
   std::string password;
   std::string user_id;
   int balance;
+  // the transfers this user was part of, oldest first, linked through
+  // Transfer::next()
+  Transfer *firstTransfer = NULL;
+  Transfer *lastTransfer = NULL;
 };
 
 class Transfer {
  public:
+  Transfer(User *from, User *to, int amount)
+    : from(from), to(to), amount(amount), nextFrom(NULL), nextTo(NULL) {}
+
+  // the next transfer `user`, who is `from` or `to`, was part of
+  Transfer *next(const User *user) const { return user == from ? nextFrom : nextTo; }
+
   User *from;
   User *to;
   int amount;
+  Transfer *nextFrom;
+  Transfer *nextTo;
 };
 
 class Deposit {
  public:
+  Deposit(User *to, int amount, std::string stripe_charge_id)
+    : to(to), amount(amount), stripe_charge_id(stripe_charge_id) {}
+
   User *to;
   int amount;
   std::string stripe_charge_id;
 };
 
-// Note: you must use a single User object and hold pointers to it
-// in the `users` and `auth_tokens` databases
+/**
+ * The wallet data every service shares.
+ *
+ * Users and auth tokens are hashed into DATABASE_SHARDS shards, each
+ * with its own lock, so workers only contend when they touch the same
+ * shard. A user's fields, balance included, are guarded by the lock of
+ * the shard its username hashes to: read or change them through
+ * update(), deposit() and transfer(), never directly. Users are never
+ * deleted, so a User pointer stays good for the life of the database.
+ *
+ * Transfers and deposits go to append-only logs that are read without
+ * locking.
+ *
+ * After open(), users, transfers and deposits are also written to a
+ * Ledger on disk, and every method that changes them returns only once
+ * the change is durable. Auth tokens stay in memory.
+ */
 class Database {
  public:
-  // the key is the username
-  std::map<std::string, User *> users;
-  // the key is the auth_token
-  std::map<std::string, User *> auth_tokens;
-  // A vector of all transfers for all users
-  std::vector<Transfer *> transfers;
-  // A vector of all deposits for all users
-  std::vector<Deposit *> deposits;
+  Database();
+  ~Database();
+
+  /**
+   * Recovers the users and their balances from the ledger in `dir`,
+   * then logs every change there. A snapshot of all users is taken
+   * every `snapshotEvery` changes, which bounds how much log the next
+   * recovery has to replay. Call once, before anything else. Throws
+   * LedgerError if the ledger can't be read.
+   */
+  void open(const std::string &dir, uint64_t snapshotEvery = 100000);
+
+  /**
+   * Takes ownership of `user` and stores it under its username.
+   * Returns false, leaving `user` to the caller, if the name is taken.
+   */
+  bool addUser(User *user);
+
+  /**
+   * @return the user named `username`, or NULL if there isn't one
+   */
+  User *findUser(const std::string &username);
+
+  /**
+   * Runs `fn` on `user` with its shard locked, for reading or changing
+   * its fields consistently. `fn` must not call back into the database.
+   */
+  void update(User *user, const std::function<void(User *)> &fn);
+
+  /**
+   * Runs `fn` on `user` with its shard locked, for reading its fields
+   * and walking its transfers consistently. Unlike update() nothing is
+   * copied or logged, so it doesn't allocate. `fn` must not call back
+   * into the database or change `user`.
+   */
+  template <typename Fn>
+  void read(const User *user, Fn fn) {
+    Shard *shard = shardFor(user->username);
+    dthread_mutex_lock(&shard->lock);
+    try {
+      fn(user);
+    } catch (...) {
+      dthread_mutex_unlock(&shard->lock);
+      throw;
+    }
+    dthread_mutex_unlock(&shard->lock);
+  }
+
+  // auth tokens, each pointing at the single User object it was given
+  // for, until it expires `ttlSeconds` later
+  void addToken(const std::string &token, User *user, int ttlSeconds = DEFAULT_TOKEN_TTL_SECONDS);
+  // NULL for unknown and expired tokens; `expiresUs` is when the token
+  // stops working, on the nowUs() clock
+  User *findToken(const std::string &token, uint64_t *expiresUs = NULL);
+  // returns false if there was no such token
+  bool removeToken(const std::string &token);
+
+  /**
+   * Goes up every time a token is removed or given out again, so
+   * anything remembering tokens it looked up can tell when it has to
+   * look again.
+   */
+  uint64_t tokenEpoch() { return m_tokenEpoch.load(std::memory_order_acquire); }
+
+  // microseconds on the monotonic clock
+  static uint64_t nowUs();
+
+  /**
+   * Moves `amount` from `from` to `to` and logs it, or returns false
+   * if `from` doesn't have that much. Locks both users' shards, always
+   * the lower numbered one first, so two transfers in opposite
+   * directions can't deadlock.
+   */
+  bool transfer(User *from, User *to, int amount);
+
+  /**
+   * Adds `amount` to `to`'s balance and logs it.
+   */
+  void deposit(User *to, int amount, const std::string &stripe_charge_id);
+
+  // every transfer and deposit, oldest first, since the last snapshot
+  // when the database was opened. A user's own transfers are quicker
+  // to reach through read() and User::firstTransfer. Nothing is ever
+  // dropped from these while running, so they grow with every change
+  // until the next restart
+  AppendLog<Transfer> transfers;
+  AppendLog<Deposit> deposits;
 
   // set by config.json
   std::string stripe_secret_key;
+
+ private:
+  struct Token {
+    User *user;
+    uint64_t expiresUs;
+  };
+
+  struct Shard {
+    pthread_mutex_t lock;
+    // the key is the username
+    std::unordered_map<std::string, User *> users;
+    // the key is the auth_token
+    std::unordered_map<std::string, Token> auth_tokens;
+    // purge expired tokens once the table grows to this size
+    size_t sweepAt;
+  } __attribute__((aligned(64)));
+
+  Shard *shardFor(const std::string &key);
+  // appends to the ledger, if there is one. Call with the shards of the
+  // users in `record` locked
+  uint64_t logChange(const std::string &record);
+  // waits for `seq` to be durable, then snapshots if one is due
+  void commit(uint64_t seq);
+  void snapshot();
+  // adds `transfer` to the transfers of both its users. Call with
+  // their shards locked
+  void link(Transfer *transfer);
+  void replay(const std::string &record);
+
+  Shard m_shards[DATABASE_SHARDS];
+  Ledger *m_ledger;
+  uint64_t m_snapshotEvery;
+  std::atomic<bool> m_snapshotting;
+  std::atomic<uint64_t> m_tokenEpoch;
 };
 
 #endif
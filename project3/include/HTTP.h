@@ -2,8 +2,12 @@
 #define _HTTP_H_
 
 #include "http_parser.h"
+#include "Arena.h"
+
+#include <stdint.h>
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 
@@ -11,9 +15,21 @@ class HTTP {
  public:
     typedef enum {INIT, HEADER, FIELD, VALUE, BODY, DONE} HttpState;
 
-    HTTP(http_parser_type httpType = HTTP_REQUEST);
+    /**
+     * With an arena, the receive buffer, header table and body all come
+     * out of it, so the HTTP object must not outlive the arena's next
+     * reset.
+     */
+    HTTP(http_parser_type httpType = HTTP_REQUEST, Arena *arena = NULL);
     ~HTTP();
 
+    /**
+     * Returns room for at least `len` more bytes at the end of the
+     * receive buffer. Read into it and then call addReceived with the
+     * number of bytes that actually arrived.
+     */
+    char *recvBuffer(size_t len);
+    int addReceived(size_t len);
     int addData(const unsigned char *data, int len);
     bool isDone();
     bool isHeaderDone();
@@ -22,6 +38,7 @@ class HTTP {
     std::string getHost();
     std::string getUrl();
     std::string getPath();
+    http_method getMethod() {return (http_method) m_method;}
     bool isConnect() {return m_method == HTTP_CONNECT;}
     bool isHead() {return m_method == HTTP_HEAD;}
     bool isGet() {return m_method == HTTP_GET;}
@@ -29,12 +46,61 @@ class HTTP {
     bool isPost() {return m_method == HTTP_POST;}
     bool isDelete() {return m_method == HTTP_DELETE;}
     std::string getBody();
-    std::string getQuery() {return m_query;}
-    std::vector< std::pair< std::string *, std::string *> > getHeaders() {
-      return m_headers;
+    // the body in the receive buffer, dechunked, without copying it
+    std::string_view getBodyView() {return view(m_body);}
+
+    /**
+     * The body in the receive buffer, NUL terminated and writable, for
+     * parsers that work in place. Only valid once the request has been
+     * parsed, and for the lifetime of this object.
+     */
+    char *getBodyInsitu();
+    // roughly how many bytes of the message were headers, once they've
+    // all been parsed
+    size_t getHeaderLength() {return m_headerLength;}
+    size_t getBodyLength() {return m_body.length;}
+    // how much more body the parser is waiting for in the current
+    // Content-Length or chunk, or -1 if it doesn't know
+    int64_t getExpectedBodyBytes() {return m_parser.content_length;}
+    std::string getQuery() {return std::string(getQueryView());}
+
+    // Views into the receive buffer, valid for the lifetime of this
+    // object once the request has been parsed
+    std::string_view getUrlView() {return view(m_url);}
+    std::string_view getPathView() {return view(m_path);}
+    std::string_view getQueryView() {return view(m_query);}
+
+    size_t numHeaders() {return m_headers.size();}
+    std::string_view headerField(size_t idx) {return view(m_headers[idx].first);}
+    std::string_view headerValue(size_t idx) {return view(m_headers[idx].second);}
+
+    /**
+     * Case-insensitive header lookup. Returns false, leaving `value`
+     * alone, if the header wasn't sent. Only valid once the headers
+     * have been parsed.
+     */
+    bool findHeader(std::string_view field, std::string_view *value);
+
+    /**
+     * The x-auth-token header, picked out once while the headers are
+     * indexed. Returns false if the request didn't send one.
+     */
+    bool getAuthToken(std::string_view *token) {
+        if(!m_hasAuthToken) {
+            return false;
+        }
+        *token = view(m_authToken);
+        return true;
     }
-  
+
  private:
+    // a run of bytes in m_raw; offsets instead of pointers so the
+    // buffer can grow while we're still reading
+    struct Span {
+        uint32_t offset;
+        uint32_t length;
+    };
+
     static int message_begin_cb(http_parser *parser);
     static int path_cb(http_parser *parser, const char *at, size_t length);
     static int query_string_cb(http_parser *parser, const char *at, size_t length);
@@ -46,13 +112,17 @@ class HTTP {
     static int body_cb(http_parser *parser, const char *at, size_t length);
     static int message_complete_cb(http_parser *parser);
 
+    static uint32_t hashField(std::string_view field);
+
     HttpState getState();
     void setState(HttpState newState);
-    void appendUrl(const char *at, size_t len);
+    void extend(Span *span, const char *at, size_t len);
+    void appendBody(const char *at, size_t len);
+    std::string_view view(const Span &span) {
+        return std::string_view(m_raw.data() + span.offset, span.length);
+    }
     void newHeaderField(const char *at, size_t len);
-    void appendHeaderField(const char *at, size_t len);
-    void appendHeaderValue(const char *at, size_t len);
-    void addHeaderField();
+    void indexHeaders();
     void messageComplete(unsigned char method);
 
     http_parser_settings m_settings;
@@ -61,14 +131,26 @@ class HTTP {
     bool m_doneParsing;
     bool m_headerDone;
 
-    std::string m_url;
-    std::string m_path;
-    std::string m_query;
+    // every byte received so far, m_rawUsed of them are valid and
+    // m_rawParsed of those have been through the parser
+    ArenaString m_raw;
+    size_t m_rawUsed;
+    size_t m_rawParsed;
+
+    Span m_url;
+    Span m_path;
+    Span m_query;
     std::string m_host;
-    std::string *m_field;
-    std::string *m_value;
-    std::vector< std::pair< std::string *, std::string *> > m_headers;
-    std::string m_body;
+    Span m_authToken;
+    bool m_hasAuthToken;
+    ArenaVector< std::pair<Span, Span> > m_headers;
+    size_t m_headerLength;
+    // open addressing table of indexes into m_headers, keyed by the
+    // lower-cased field name
+    ArenaVector<uint16_t> m_headerIndex;
+    // chunked bodies are compacted in place, so this always covers the
+    // whole body
+    Span m_body;
     std::string m_statusStr;
     unsigned char m_method;
     http_parser_type m_httpType;
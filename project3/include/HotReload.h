@@ -0,0 +1,39 @@
+#ifndef _HOTRELOAD_H_
+#define _HOTRELOAD_H_
+
+#include <vector>
+
+/**
+ * Replacing a running server without closing its listening sockets.
+ *
+ * The old process starts the new binary with reexec(), which hands the
+ * listening sockets down through the environment. The new process picks
+ * them up with inheritedFds() instead of binding the port, and calls
+ * ready() once it's accepting. Connections that arrive in between wait
+ * in the sockets' backlog, so none are refused. Once reexec() returns
+ * true the old process stops accepting and finishes what it has.
+ */
+class HotReload {
+ public:
+  /**
+   * Listening sockets handed down by the process we're replacing,
+   * empty if we weren't started by reexec()
+   */
+  static std::vector<int> inheritedFds();
+
+  /**
+   * Tells the process we're replacing that it can stop accepting.
+   * Does nothing if we weren't started by reexec().
+   */
+  static void ready();
+
+  /**
+   * Starts `argv` again, normally this program, passing it
+   * `listenFds`. Returns true once the new process calls ready(), or
+   * false if it exits or hasn't within `timeoutMs`, in which case the
+   * caller should keep serving.
+   */
+  static bool reexec(char **argv, const std::vector<int> &listenFds, int timeoutMs);
+};
+
+#endif
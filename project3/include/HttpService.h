@@ -37,6 +37,27 @@ class HttpService {
    * @throws ClientError for any cases where we can't lookup the user
    */
   User *getAuthenticatedUser(HTTPRequest *request);
+
+  /**
+   * The same lookup without throwing: NULL if the request has no token
+   * or the token is unknown or expired. Tokens a worker used recently
+   * are answered from its own cache, without locking, until they
+   * expire or any token is removed.
+   */
+  User *findAuthenticatedUser(HTTPRequest *request);
+
+  /**
+   * Writes the wallet API's account body for `user` into `response`:
+   * {"email": ..., "balance": ...}
+   */
+  void sendAccount(HTTPResponse *response, User *user);
+
+  /**
+   * Writes `user`'s balance and every transfer it was part of into
+   * `response`: {"balance": ..., "transfers": [{"from": ..., "to": ...,
+   * "amount": ...}, ...]}, oldest transfer first, by username.
+   */
+  void sendTransfers(HTTPResponse *response, User *user);
   
  private:
   std::string m_pathPrefix;
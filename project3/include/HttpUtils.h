@@ -9,13 +9,9 @@
 
 #include "MySocket.h"
 
-class MalformedQueryString : public std::runtime_error {
- public:
-MalformedQueryString(std::string query) : std::runtime_error("could not parse query string " + query) {}
-};
-
 class HttpUtils {
  public:
+  // decodes `query` the way HTTPRequest::getParams() does
   static std::map<std::string, std::string> params(std::string query);
   static void writeChunk(MySocket *client, const void *buf, int numBytes);
   static void writeLastChunk(MySocket *client);
@@ -0,0 +1,39 @@
+#ifndef _JSONREQUEST_H_
+#define _JSONREQUEST_H_
+
+#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+
+#include "HTTPRequest.h"
+
+/**
+ * Parses JSON request bodies in place, in the request's receive
+ * buffer: strings are unescaped where they lie and point back into it,
+ * so the body is never copied. The buffer is changed by parsing, so
+ * read the body one way or the other, and the results are only good
+ * for as long as the request is.
+ */
+class JsonRequest {
+ public:
+  /**
+   * Builds a DOM of the body. Returns false if it isn't valid JSON.
+   */
+  static bool parse(HTTPRequest *request, rapidjson::Document *doc) {
+    doc->ParseInsitu(request->getBodyInsitu());
+    return !doc->HasParseError();
+  }
+
+  /**
+   * Streams the body through a rapidjson SAX `handler` instead, which
+   * doesn't build anything, for bodies too large to want a DOM of.
+   * Returns false if it isn't valid JSON or the handler stopped it.
+   */
+  template <typename Handler>
+  static bool parseSax(HTTPRequest *request, Handler &handler) {
+    rapidjson::InsituStringStream stream(request->getBodyInsitu());
+    rapidjson::Reader reader;
+    return !reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError();
+  }
+};
+
+#endif
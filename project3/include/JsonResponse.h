@@ -0,0 +1,65 @@
+#ifndef _JSONRESPONSE_H_
+#define _JSONRESPONSE_H_
+
+#include <string>
+
+#include "rapidjson/allocators.h"
+#include "rapidjson/writer.h"
+
+#include "HTTPResponse.h"
+
+/**
+ * rapidjson output stream that appends to a string.
+ */
+class StringOutputStream {
+ public:
+  typedef char Ch;
+
+  StringOutputStream(std::string *out) : m_out(out) {}
+  void Put(char c) { m_out->push_back(c); }
+  void Flush() {}
+
+ private:
+  std::string *m_out;
+};
+
+typedef rapidjson::Writer<StringOutputStream, rapidjson::UTF8<>, rapidjson::UTF8<>,
+                          rapidjson::MemoryPoolAllocator<> > JsonWriter;
+
+/**
+ * Builds a JSON response body in place: the writer's output goes
+ * straight into the response's body, and its nesting stack comes from
+ * a per-thread pool that each JsonResponse starts by clearing, so
+ * writing a field doesn't allocate. Keys and strings are written from
+ * the caller's memory without copies.
+ *
+ *   JsonResponse json(response);
+ *   json.writer().StartObject();
+ *   ...
+ *   json.writer().EndObject();
+ *
+ * The body is complete once writer().IsComplete() is true. Only one
+ * JsonResponse per thread may be alive at a time.
+ */
+class JsonResponse {
+ public:
+  /**
+   * Sets the content type and empties the body, reserving
+   * `expectedBytes` for it.
+   */
+  JsonResponse(HTTPResponse *response, size_t expectedBytes = 256);
+
+  JsonWriter &writer() { return m_writer; }
+
+  // shorthands for the common cases
+  void writeKey(const std::string &name) { m_writer.Key(name.data(), name.size()); }
+  void writeString(const std::string &value) { m_writer.String(value.data(), value.size()); }
+
+ private:
+  static rapidjson::MemoryPoolAllocator<> *pool();
+
+  StringOutputStream m_stream;
+  JsonWriter m_writer;
+};
+
+#endif
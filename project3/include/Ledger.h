@@ -0,0 +1,115 @@
+#ifndef _LEDGER_H_
+#define _LEDGER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class LedgerError : public std::runtime_error {
+ public:
+  LedgerError(std::string err) : std::runtime_error("ledger error: " + err) {}
+};
+
+/**
+ * Durable, append-only storage for opaque records, kept in a directory.
+ *
+ * Records are appended to the current segment file, `ledger.<gen>`,
+ * each framed with its length and a CRC32 so a torn write at the end is
+ * spotted and cut off on recovery. append() only buffers; commit()
+ * waits until a record is on disk. Whoever commits first writes and
+ * fsyncs everything buffered so far on behalf of everyone waiting, so
+ * concurrent commits share one fsync.
+ *
+ * A snapshot is a compact copy of the state, written as records to
+ * `snapshot.<gen>` for the state at the moment segment <gen> started.
+ * Recovery loads the newest complete snapshot and replays only the
+ * segments from its generation on, so how long it takes depends on how
+ * often snapshots are taken rather than on the whole history. Only
+ * the newest two snapshots and the segments since the older of them
+ * are kept, so the directory stays around two snapshots' worth of log
+ * however long the ledger runs.
+ *
+ * Methods throw LedgerError if the disk fails them.
+ */
+class Ledger {
+ public:
+  typedef std::function<void(const std::string &record)> Visitor;
+
+  /**
+   * Uses `dir`, creating it if needed. Call recover() before anything
+   * else. Only one process may use a directory at a time; throws
+   * LedgerError if another already is.
+   */
+  Ledger(const std::string &dir);
+  ~Ledger();
+
+  /**
+   * Passes every record of the newest complete snapshot to
+   * `snapshotRecord`, then every record logged since to `logRecord`,
+   * oldest first. Cuts off a torn record at the end of the last
+   * segment and opens it for appending.
+   */
+  void recover(const Visitor &snapshotRecord, const Visitor &logRecord);
+
+  /**
+   * Buffers `record` and returns its sequence number for commit().
+   * Records are written in the order they're appended.
+   */
+  uint64_t append(const std::string &record);
+
+  /**
+   * Returns once record `seq`, and everything before it, is on disk.
+   */
+  void commit(uint64_t seq);
+
+  /**
+   * Records appended since the last snapshot started.
+   */
+  uint64_t sinceSnapshot();
+
+  /**
+   * Starts a new segment after flushing the current one, and returns
+   * its generation. Call with the state locked, then take a copy of it
+   * and pass that to writeSnapshot() with the generation.
+   */
+  uint64_t rotate();
+
+  /**
+   * Writes `records` as the snapshot for `gen` and, once it's safely
+   * on disk, removes everything from before the snapshot preceding it.
+   */
+  void writeSnapshot(uint64_t gen, const std::vector<std::string> &records);
+
+  static uint32_t crc32(const char *data, size_t len);
+
+ private:
+  std::string path(const char *kind, uint64_t gen);
+  void listFiles(std::vector<uint64_t> *segments, std::vector<uint64_t> *snapshots);
+  bool readRecords(const std::string &file, const Visitor &visit, off_t *validLength);
+  void openSegment(uint64_t gen);
+  void writeAll(int fd, const std::string &data);
+  void syncDir();
+  static void frame(std::string *out, const std::string &record);
+
+  std::string m_dir;
+  // holds the lock on m_dir
+  int m_lockFd;
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_flushed;
+  int m_fd;
+  uint64_t m_gen;
+  // framed records waiting for the next flush
+  std::string m_pending;
+  uint64_t m_appended;
+  uint64_t m_durable;
+  uint64_t m_sinceSnapshot;
+  // someone is writing and syncing outside the lock
+  bool m_flushing;
+  bool m_failed;
+};
+
+#endif
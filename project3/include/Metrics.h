@@ -0,0 +1,159 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+class HttpService;
+
+// bucket layout of a LatencyCounts histogram: values below
+// 2^HISTOGRAM_SUB_BITS microseconds get a bucket each, and every power
+// of two above that is split into 2^HISTOGRAM_SUB_BITS equal buckets,
+// so a bucket is never more than 12.5% wide. Values go up to
+// 2^HISTOGRAM_MAX_BITS microseconds (about 19 hours).
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+#define METRICS_MAX_SHARDS 128
+#define METRICS_MAX_ROUTES 16
+#define METRICS_MAX_STATUS 600
+
+struct LatencyCounts {
+  std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sumUs;
+};
+
+/**
+ * One thread's counters. Each thread only adds to its own shard, so
+ * the cache lines never bounce between cores; a scrape sums them all.
+ */
+struct MetricsShard {
+  std::atomic<int64_t> inFlight;
+  std::atomic<int64_t> queued;
+  std::atomic<uint64_t> shed;
+  std::atomic<int64_t> workers;
+  std::atomic<uint64_t> spawned;
+  std::atomic<uint64_t> retired;
+  std::atomic<uint64_t> statusCounts[METRICS_MAX_STATUS];
+  // the last slot counts requests no service matched
+  std::atomic<uint64_t> routeCounts[METRICS_MAX_ROUTES + 1];
+  // indexed by Metrics::Phase
+  LatencyCounts phases[4];
+} __attribute__((aligned(64)));
+
+/**
+ * Every counter the server keeps. Plain data without pointers, so it
+ * can live anywhere, including memory shared between processes.
+ */
+struct MetricsRegion {
+  std::atomic<uint32_t> nextShard;
+  // set for claimed shards whose thread has exited, so the next new
+  // thread can take them over
+  std::atomic<uint8_t> released[METRICS_MAX_SHARDS];
+  // the process each shard was claimed by, kept after it's released
+  // until releaseProcess(); 0 once that has zeroed its gauges
+  std::atomic<int32_t> owners[METRICS_MAX_SHARDS];
+  MetricsShard shards[METRICS_MAX_SHARDS];
+};
+
+/**
+ * Request counters and latency histograms.
+ *
+ * Recording is lock-free and doesn't allocate: each thread claims a
+ * shard of the region the first time it records anything. Threads
+ * beyond METRICS_MAX_SHARDS share the last shard, which still counts
+ * correctly, just with some contention. Threads that come and go should
+ * call releaseShard() on the way out. Nothing is aggregated until
+ * render() is called.
+ */
+class Metrics {
+ public:
+  typedef enum {QUEUE, PARSE, SERVICE, WRITE, NUM_PHASES} Phase;
+
+  /**
+   * With no region, the counters are allocated on the heap.
+   */
+  Metrics(MetricsRegion *region = NULL);
+  ~Metrics();
+
+  /**
+   * A zeroed region in memory shared with every process forked after
+   * this, so their counts add up in one place. NULL if it can't be
+   * mapped. It's never unmapped.
+   */
+  static MetricsRegion *newSharedRegion();
+
+  /**
+   * Records into `region` from now on, dropping whatever was counted
+   * so far. Call before any other thread records anything. A thread
+   * that forks starts the child with no shard of its own, so the
+   * child's threads claim their own in a shared region.
+   */
+  void attach(MetricsRegion *region);
+
+  /**
+   * Names `service` in the per route counts, by its path prefix. Call
+   * at startup, before any requests are recorded.
+   */
+  void addRoute(HttpService *service);
+
+  /**
+   * Counts a finished request. `service` is NULL if nothing matched.
+   */
+  void countRequest(HttpService *service, int status);
+  void countShed();
+  void recordLatency(Phase phase, uint64_t us);
+  void addInFlight(int delta);
+  void addQueued(int delta);
+  void addWorkers(int delta);
+  // pool growth and shrinkage
+  void countSpawned();
+  void countRetired();
+
+  /**
+   * Hands the calling thread's shard to the next thread that needs
+   * one. Its counts stay in the totals.
+   */
+  void releaseShard();
+
+  /**
+   * Hands back every shard of process `pid`, which has exited, and
+   * any of its threads released. Its counts stay in the totals, but its
+   * gauges go to zero, since what it had in flight died with it. Until
+   * then only `pid` reuses shards it released. Only the last
+   * shard, shared by the threads past the limit, keeps whatever the
+   * process left in it.
+   */
+  void releaseProcess(pid_t pid);
+
+  /**
+   * Appends all of the metrics in the Prometheus text format.
+   */
+  void render(std::string *out);
+
+  static uint64_t nowUs();
+
+ private:
+  MetricsShard *shard();
+  uint32_t claimShard();
+  static int bucketFor(uint64_t us);
+  static uint64_t bucketUpperUs(int bucket);
+  static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  void sumLatency(Phase phase, uint64_t *buckets, uint64_t *count, uint64_t *sumUs);
+
+  MetricsRegion *m_region;
+  bool m_ownsRegion;
+  std::vector<HttpService *> m_routes;
+  std::vector<std::string> m_routeNames;
+};
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _METRICSSERVICE_H_
+#define _METRICSSERVICE_H_
+
+#include "HttpService.h"
+#include "Metrics.h"
+
+/**
+ * Serves the server's metrics at /metrics in the Prometheus text
+ * format.
+ */
+class MetricsService : public HttpService {
+ public:
+  MetricsService(Metrics *metrics);
+
+  virtual void get(HTTPRequest *request, HTTPResponse *response);
+
+ private:
+  Metrics *m_metrics;
+};
+
+#endif
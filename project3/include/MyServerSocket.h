@@ -6,6 +6,8 @@
 
 #include "MySocket.h"
 
+typedef struct ssl_ctx_st SSL_CTX;
+
 class MyServerSocket {
  public:
   /**
@@ -13,19 +15,37 @@ class MyServerSocket {
    * if it cannot bind, it will throw a socket exception.
    *
    * @param port the port to bind to
+   * @param reusePort lets several sockets listen on the same port, with
+   * the kernel spreading new connections between them
+   */
+  MyServerSocket(int port, bool reusePort = false);
+  MyServerSocket() { serverFd = -1; tlsCtx = NULL; }
+
+  /**
+   * wraps a socket that is already bound and listening, such as one
+   * inherited from the process we're replacing
    */
-  MyServerSocket(int port);
-  MyServerSocket() { serverFd = -1; }
+  static MyServerSocket *fromFd(int fd);
   
   /**
    * this function will accept incoming requests to connect and
-   * return the resulting socket
+   * return the resulting socket. If `wakeFd` becomes readable while
+   * we're waiting it gives up and returns NULL instead.
+   */
+  MySocket *accept(int wakeFd = -1);
+
+  void close();
+
+  /**
+   * makes accept() return TLS connections using `ctx`, which the
+   * caller keeps ownership of; NULL goes back to plain TCP
    */
-  MySocket *accept();
+  void setTls(SSL_CTX *ctx) { tlsCtx = ctx; }
 
   int getFd() { return serverFd; }
  protected:
   int serverFd;
+  SSL_CTX *tlsCtx;
 
 };
 
@@ -0,0 +1,61 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_parser.h"
+#include "HttpService.h"
+
+/**
+ * Maps request paths to services and request methods to service
+ * handlers.
+ *
+ * The router is built once at startup and then only read, so workers
+ * can share it without locking. Services are kept in a radix trie
+ * keyed by their path prefix and a lookup returns the service with the
+ * longest prefix of the path. When two services register the same
+ * prefix the first one wins. Lookups don't allocate.
+ */
+class Router {
+ public:
+  typedef void (HttpService::*Handler)(HTTPRequest *request, HTTPResponse *response);
+
+  Router();
+  ~Router();
+
+  /**
+   * Registers `service` under its pathPrefix().
+   */
+  void addService(HttpService *service);
+
+  /**
+   * @return the service with the longest prefix of `path`, or NULL if
+   * none matches
+   */
+  HttpService *findService(std::string_view path);
+
+  /**
+   * @return the HttpService method that handles `method`, or NULL if
+   * the server doesn't implement it
+   */
+  Handler findHandler(http_method method);
+
+ private:
+  struct Node {
+    // the bytes on the edge from the parent to this node
+    std::string label;
+    HttpService *service;
+    std::vector<Node *> children;
+  };
+
+  static void deleteNode(Node *node);
+  void insert(Node *node, std::string_view prefix, HttpService *service);
+
+  Node *m_root;
+  // indexed by http_method
+  Handler m_handlers[HTTP_MERGE + 1];
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * The CPUs we're allowed to run on, grouped by NUMA node as the kernel
+ * lists them under /sys/devices/system/node. A machine without NUMA,
+ * or without sysfs, looks like a single node holding every CPU.
+ *
+ * Nodes are numbered from 0 in the order found and nodes with none of
+ * our CPUs are left out, so the numbers don't have to match the
+ * kernel's.
+ */
+class Topology {
+ public:
+  Topology();
+
+  int numNodes() { return m_nodes.size(); }
+  const std::vector<int> &cpus(int node) { return m_nodes[node]; }
+
+  /**
+   * Parses a sysfs CPU list such as "0-3,8,10-11".
+   */
+  static std::vector<int> parseCpuList(const std::string &list);
+
+  /**
+   * Makes threads created with `attr` run only on `cpus`, so they
+   * start out there and everything they touch first is allocated from
+   * that node's memory. Returns false if the affinity can't be set.
+   */
+  static bool setAffinity(pthread_attr_t *attr, const std::vector<int> &cpus);
+
+ private:
+  std::vector<std::vector<int> > m_nodes;
+};
+
+#endif
@@ -2,8 +2,13 @@
 #define _DTHREAD_H_
 
 #include <pthread.h>
+#include <time.h>
 #include <string>
 
+#ifndef DTHREAD_NO_TRACE
+
+#define DTHREAD_TRACING 1
+
 int dthread_create(pthread_t *thread, const pthread_attr_t *attr,
 		   void *(*start_routine)(void *), void *arg);
 int dthread_detach(pthread_t thread);
@@ -12,6 +17,9 @@ int dthread_mutex_lock(pthread_mutex_t *mutex);
 int dthread_mutex_unlock(pthread_mutex_t *mutex);
 
 int dthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+// returns ETIMEDOUT once `abstime`, on the condition's clock, has passed
+int dthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+			   const struct timespec *abstime);
 int dthread_cond_signal(pthread_cond_t *cond);
 int dthread_cond_broadcast(pthread_cond_t *cond);
 
@@ -19,5 +27,43 @@ int dthread_cond_broadcast(pthread_cond_t *cond);
 // don't use these, they're used by the autograder
 void sync_print(std::string function, std::string payload);
 void set_log_file(std::string file_name);
+// writes out every line logged so far and stops logging; for exiting
+// without atexit, and safe in a signal handler
+void flush_log();
+// a forked child logs nothing until it calls this, on the same file
+void restart_log_writer();
+
+#else
+
+// Release builds (make RELEASE=1): the wrappers compile down to the
+// pthread calls and the autograder tracing disappears entirely.
+
+#define DTHREAD_TRACING 0
+
+inline int dthread_create(pthread_t *thread, const pthread_attr_t *attr,
+			  void *(*start_routine)(void *), void *arg) {
+  return pthread_create(thread, attr, start_routine, arg);
+}
+inline int dthread_detach(pthread_t thread) { return pthread_detach(thread); }
+
+inline int dthread_mutex_lock(pthread_mutex_t *mutex) { return pthread_mutex_lock(mutex); }
+inline int dthread_mutex_unlock(pthread_mutex_t *mutex) { return pthread_mutex_unlock(mutex); }
+
+inline int dthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  return pthread_cond_wait(cond, mutex);
+}
+inline int dthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+				  const struct timespec *abstime) {
+  return pthread_cond_timedwait(cond, mutex, abstime);
+}
+inline int dthread_cond_signal(pthread_cond_t *cond) { return pthread_cond_signal(cond); }
+inline int dthread_cond_broadcast(pthread_cond_t *cond) { return pthread_cond_broadcast(cond); }
+
+inline void sync_print(const std::string &/*function*/, const std::string &/*payload*/) {}
+inline void set_log_file(const std::string &/*file_name*/) {}
+inline void flush_log() {}
+inline void restart_log_writer() {}
+
+#endif
 
 #endif
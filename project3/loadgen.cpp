@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "HttpClient.h"
+
+using namespace std;
+
+string HOST = "localhost";
+int PORT = 8080;
+int CONNECTIONS = 8;
+/// Requests per second to start, 0 to go as fast as the connections can
+double RATE = 0;
+double DURATION = 10;
+bool USE_TLS = false;
+/// Reuse each client's connection instead of connecting per request
+bool KEEP_ALIVE = false;
+string MIXFILE = "";
+string REQUEST_PATH = "/hello_world.html";
+
+/// One kind of request in the mix, picked `weight` times out of the
+/// total weight of the mix
+struct MixEntry {
+  int weight;
+  string method;
+  string path;
+  string body;
+};
+
+vector<MixEntry> mix;
+int total_weight = 0;
+
+/// What one connection saw
+struct WorkerStats {
+  vector<uint64_t> latencies_us;
+  map<int, long> statuses;
+  long errors;
+};
+
+/// Requests are numbered in the order they are due; each connection
+/// takes the next number when it's free
+atomic<uint64_t> next_ticket(0);
+uint64_t start_ns;
+uint64_t end_ns;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+/// Read the mix file: one request per line as `weight method path
+/// [body]`. Blank lines and lines starting with # are skipped
+void load_mix(string file_name) {
+  ifstream file(file_name.c_str());
+  if (!file) {
+    cerr << "can't open mix file " << file_name << endl;
+    exit(1);
+  }
+
+  string line;
+  while (getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    stringstream fields(line);
+    MixEntry entry;
+    if (!(fields >> entry.weight >> entry.method >> entry.path) || entry.weight <= 0) {
+      cerr << "bad mix line: " << line << endl;
+      exit(1);
+    }
+    getline(fields >> ws, entry.body);
+    mix.push_back(entry);
+  }
+}
+
+const MixEntry &pick(unsigned int *seed) {
+  int choice = rand_r(seed) % total_weight;
+  for (size_t idx = 0; idx < mix.size(); idx++) {
+    if (choice < mix[idx].weight) {
+      return mix[idx];
+    }
+    choice -= mix[idx].weight;
+  }
+  return mix.back();
+}
+
+/// Returns the response status, or -1 if the request failed. With
+/// keep-alive `client` is kept between calls, otherwise every request
+/// gets a client of its own
+int send_request(HttpClient **client, const MixEntry &entry) {
+  try {
+    if (*client == NULL) {
+      *client = new HttpClient(HOST.c_str(), PORT, USE_TLS);
+      (*client)->set_keep_alive(KEEP_ALIVE, 1);
+    }
+    (*client)->write_request(entry.path, entry.method, entry.body);
+    // we only want the status, so don't keep the body around
+    HTTPClientResponse *response = (*client)->read_response([](const char *, size_t) {});
+    int status = response->status();
+    delete response;
+    if (!KEEP_ALIVE) {
+      delete *client;
+      *client = NULL;
+    }
+    return status > 0 ? status : -1;
+  } catch (...) {
+    // start over with a new client next time
+    delete *client;
+    *client = NULL;
+    return -1;
+  }
+}
+
+/// Start routine of a connection
+void *worker(void *arg) {
+  WorkerStats *stats = (WorkerStats *) arg;
+  unsigned int seed = (unsigned int) (uintptr_t) arg;
+  HttpClient *client = NULL;
+
+  while (true) {
+    uint64_t ticket = next_ticket++;
+    uint64_t due;
+    if (RATE > 0) {
+      // open loop: latency counts from when the request was due, not
+      // from when a connection got around to it, so a slow server
+      // can't hide its queueing from us
+      due = start_ns + (uint64_t) (ticket * 1e9 / RATE);
+      if (due >= end_ns) {
+        break;
+      }
+      sleep_until(due);
+    } else {
+      due = now_ns();
+      if (due >= end_ns) {
+        break;
+      }
+    }
+
+    int status = send_request(&client, pick(&seed));
+    uint64_t done = now_ns();
+    if (status < 0) {
+      stats->errors++;
+      continue;
+    }
+    stats->statuses[status]++;
+    stats->latencies_us.push_back((done - due) / 1000);
+  }
+
+  delete client;
+  return NULL;
+}
+
+double percentile_ms(const vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t idx = min(sorted.size() - 1, (size_t) (p * sorted.size()));
+  return sorted[idx] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  int option;
+
+  // a server closing a kept alive connection shouldn't kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  while ((option = getopt(argc, argv, "h:p:c:r:d:m:sk")) != -1) {
+    switch (option) {
+    case 'h':
+      HOST = string(optarg);
+      break;
+    case 'p':
+      PORT = atoi(optarg);
+      break;
+    case 'c':
+      CONNECTIONS = atoi(optarg);
+      break;
+    case 'r':
+      RATE = atof(optarg);
+      break;
+    case 'd':
+      DURATION = atof(optarg);
+      break;
+    case 'm':
+      MIXFILE = string(optarg);
+      break;
+    case 's':
+      USE_TLS = true;
+      break;
+    case 'k':
+      KEEP_ALIVE = true;
+      break;
+    default:
+      cerr << "usage: " << argv[0] << " [-h host] [-p port] [-c connections] [-r requests_per_second]"
+           << " [-d seconds] [-m mix_file] [-s] [-k] [path]" << endl;
+      exit(1);
+    }
+  }
+  if (optind < argc) {
+    REQUEST_PATH = string(argv[optind]);
+  }
+  if (CONNECTIONS <= 0) {
+    cerr << "need at least one connection" << endl;
+    exit(1);
+  }
+
+  if (MIXFILE.empty()) {
+    mix.push_back({1, "GET", REQUEST_PATH, ""});
+  } else {
+    load_mix(MIXFILE);
+  }
+  for (size_t idx = 0; idx < mix.size(); idx++) {
+    total_weight += mix[idx].weight;
+  }
+  if (total_weight == 0) {
+    cerr << "empty mix" << endl;
+    exit(1);
+  }
+
+  vector<WorkerStats> stats(CONNECTIONS);
+  vector<pthread_t> threads(CONNECTIONS);
+  start_ns = now_ns();
+  end_ns = start_ns + (uint64_t) (DURATION * 1e9);
+  for (int idx = 0; idx < CONNECTIONS; idx++) {
+    stats[idx].errors = 0;
+    if (pthread_create(&threads[idx], NULL, &worker, &stats[idx])) {
+      cerr << "failed to create thread" << endl;
+      return 1;
+    }
+  }
+
+  vector<uint64_t> latencies;
+  map<int, long> statuses;
+  long errors = 0;
+  for (int idx = 0; idx < CONNECTIONS; idx++) {
+    pthread_join(threads[idx], NULL);
+    latencies.insert(latencies.end(), stats[idx].latencies_us.begin(), stats[idx].latencies_us.end());
+    map<int, long>::iterator iter;
+    for (iter = stats[idx].statuses.begin(); iter != stats[idx].statuses.end(); iter++) {
+      statuses[iter->first] += iter->second;
+    }
+    errors += stats[idx].errors;
+  }
+  double elapsed = (now_ns() - start_ns) / 1e9;
+  sort(latencies.begin(), latencies.end());
+
+  cout << fixed << setprecision(2);
+  cout << "requests: " << latencies.size() << "  errors: " << errors
+       << "  time: " << elapsed << "s  throughput: " << latencies.size() / elapsed << " req/s" << endl;
+  cout << setprecision(3);
+  cout << "latency ms  p50: " << percentile_ms(latencies, 0.5)
+       << "  p99: " << percentile_ms(latencies, 0.99)
+       << "  p999: " << percentile_ms(latencies, 0.999)
+       << "  max: " << (latencies.empty() ? 0 : latencies.back() / 1000.0) << endl;
+  map<int, long>::iterator iter;
+  for (iter = statuses.begin(); iter != statuses.end(); iter++) {
+    cout << "status " << iter->first << ": " << iter->second << endl;
+  }
+  if (RATE > 0 && latencies.size() + errors < 0.95 * RATE * DURATION) {
+    cout << "warning: fell behind the target rate, try more connections (-c)" << endl;
+  }
+
+  return 0;
+}
@@ -5,12 +5,14 @@
  * contributors and the software license agreement.
  */
 
-#include <stdlib.h>
-#include <assert.h>
 #include <string.h>
 
 #include <string>
-#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86
+#endif
 
 #include "Base64.h"
 
@@ -19,148 +21,352 @@
 
 using namespace std;
 
+static constexpr char s_alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static constexpr char s_urlAlphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
 /**
- * Convert 6 bit values to base64 chars
+ * 6 bit values by base64 char, -1 for chars that aren't in the alphabet
  */
-static char getBase64CharValue(uint8_t bits) {
-        // Note: the bits >= 0 check is omitted because these are
-        // unsigned numbers and the compiler is complaining
-        if (bits <= 25) {
-                return 'A' + bits;
-        }
-
-        if ((bits >= 26) && (bits <= 51)) {
-                return 'a' + bits - 26;
-        }
+struct DecodeTable {
+        signed char value[256];
 
-        if ((bits >= 52) && (bits <= 61)) {
-                return '0' + bits - 52;
+        constexpr DecodeTable(const char *alphabet) : value() {
+                for (int idx = 0; idx < 256; idx++) {
+                        value[idx] = -1;
+                }
+                for (int idx = 0; idx < 64; idx++) {
+                        value[(unsigned char) alphabet[idx]] = idx;
+                }
         }
+};
 
-        if (bits == 62) {
-                return '+';
-        }
+static constexpr DecodeTable s_values(s_alphabet);
+static constexpr DecodeTable s_urlValues(s_urlAlphabet);
 
-        if (bits == 63) {
-                return '/';
-        }
+/**
+ * The bulk of the work: each of these goes through as many whole
+ * blocks of the input as it safely can, and returns how much of the
+ * input it used. The scalar code does the rest.
+ */
+struct Codec {
+        const char *name;
+        size_t (*encodeBlocks)(const uint8_t *data, size_t len, char *out, bool urlSafe);
+        // standard alphabet only; stops early at anything else
+        size_t (*decodeBlocks)(const char *in, size_t len, uint8_t *out);
+};
+
+static size_t noBlocks(const uint8_t *, size_t, char *, bool) {
+        return 0;
+}
 
-        // sanity check, should be impossible to trigger with public
-        // functions
-        throw "invalid Base64 bit value";
+static size_t noBlocks(const char *, size_t, uint8_t *) {
+        return 0;
 }
 
-/**
- * Convert base64 char to a 6 bit value
+static const Codec s_scalar = {"scalar", noBlocks, noBlocks};
+
+#ifdef BASE64_X86
+
+/*
+ * The SIMD code is the well known pshufb approach (Muła and Lemire,
+ * "Faster Base64 Encoding and Decoding Using AVX2 Instructions").
+ * Encoding spreads each 3 bytes over 4 lanes and shifts the 6 bit
+ * groups into place with multiplies, then turns values into chars by
+ * adding an offset looked up by range. Decoding checks every char is
+ * in the alphabet with two nibble lookups, subtracts the offset back
+ * out, and packs the groups together with multiply-adds.
  */
-static uint8_t getBase64ByteValue(char c) {
-        if ((c >= 'A') && (c <= 'Z')) {
-                return c - 'A';
-        }
 
-        if ((c >= 'a') && (c <= 'z')) {
-                return c - 'a' + 26;
-        }
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i encodeLanes(__m128i in, bool urlSafe) {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i high = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                                       _mm_set1_epi32(0x04000040));
+        __m128i low = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                                      _mm_set1_epi32(0x01000010));
+        __m128i values = _mm_or_si128(high, low);
+
+        // 0-25 use offset 0, 26-51 offset 1, 52-61 offsets 2-11, 62 and 63
+        // offsets 12 and 13
+        __m128i offsets = urlSafe ?
+                _mm_setr_epi8('A', 'a' - 26, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+                              '-' - 62, '_' - 63, 0, 0) :
+                _mm_setr_epi8('A', 'a' - 26, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+                              '+' - 62, '/' - 63, 0, 0);
+        __m128i index = _mm_subs_epu8(values, _mm_set1_epi8(51));
+        index = _mm_sub_epi8(index, _mm_cmpgt_epi8(values, _mm_set1_epi8(25)));
+        return _mm_add_epi8(values, _mm_shuffle_epi8(offsets, index));
+}
 
-        if ((c >= '0') && (c <= '9')) {
-                return c - '0' + 52;
+__attribute__((target("ssse3"), always_inline))
+static inline size_t encodeSsse3(const uint8_t *data, size_t len, char *out, bool urlSafe) {
+        size_t pos = 0;
+        // each load is 16 bytes, of which 12 are used
+        for (; len - pos >= 16; pos += 12) {
+                __m128i in = _mm_loadu_si128((const __m128i *) (data + pos));
+                _mm_storeu_si128((__m128i *) out, encodeLanes(in, urlSafe));
+                out += 16;
         }
+        return pos;
+}
 
-        if (c == '+') {
-                return 62;
+// zero if all 16 chars are valid, in which case `values` is set
+__attribute__((target("ssse3"), always_inline))
+static inline int decodeLanes(__m128i in, __m128i *values) {
+        const __m128i lowLut = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                             0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const __m128i highLut = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i offsets = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i slash = _mm_set1_epi8(0x2f);
+
+        __m128i highNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), slash);
+        __m128i lowNibbles = _mm_and_si128(in, slash);
+        __m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lowLut, lowNibbles),
+                                        _mm_shuffle_epi8(highLut, highNibbles));
+        int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(invalid, _mm_setzero_si128()));
+        if (mask != 0) {
+                return mask;
         }
 
-        if (c == '/') {
-                return 63;
+        // '/' shares its high nibble with '+', so it needs its own offset
+        __m128i index = _mm_add_epi8(_mm_cmpeq_epi8(in, slash), highNibbles);
+        __m128i sextets = _mm_add_epi8(in, _mm_shuffle_epi8(offsets, index));
+        __m128i pairs = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+        __m128i triples = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        *values = _mm_shuffle_epi8(triples, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                          -1, -1, -1, -1));
+        return 0;
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline size_t decodeSsse3(const char *in, size_t len, uint8_t *out) {
+        size_t pos = 0;
+        // each store is 16 bytes, of which 12 are used; stopping with 24
+        // chars to go leaves at least 18 bytes of room for the last one
+        for (; len - pos >= 24; pos += 16) {
+                __m128i values;
+                if (decodeLanes(_mm_loadu_si128((const __m128i *) (in + pos)), &values) != 0) {
+                        break;
+                }
+                _mm_storeu_si128((__m128i *) out, values);
+                out += 12;
         }
+        return pos;
+}
+
+/*
+ * The AVX2 versions run the same code in both 128 bit lanes at once,
+ * and finish with the SSSE3 code above. That's always inlined so it
+ * gets the AVX encodings here: calling legacy SSE code straight after
+ * AVX code stalls on the upper halves of the registers, which cost
+ * short inputs several times what the SIMD saved.
+ */
+
+__attribute__((target("avx2")))
+static __m256i encodeLanes(__m256i in, bool urlSafe) {
+        const __m256i spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+        in = _mm256_shuffle_epi8(in, spread);
+        __m256i high = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                                          _mm256_set1_epi32(0x04000040));
+        __m256i low = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                                         _mm256_set1_epi32(0x01000010));
+        __m256i values = _mm256_or_si256(high, low);
+
+        __m128i offsets = urlSafe ?
+                _mm_setr_epi8('A', 'a' - 26, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+                              '-' - 62, '_' - 63, 0, 0) :
+                _mm_setr_epi8('A', 'a' - 26, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+                              '+' - 62, '/' - 63, 0, 0);
+        __m256i index = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+        index = _mm256_sub_epi8(index, _mm256_cmpgt_epi8(values, _mm256_set1_epi8(25)));
+        return _mm256_add_epi8(values, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(offsets),
+                                                           index));
+}
 
-        if (c == '=') {
-                return 0;
+__attribute__((target("avx2")))
+static size_t encodeAvx2(const uint8_t *data, size_t len, char *out, bool urlSafe) {
+        size_t pos = 0;
+        // 12 bytes for each lane, loaded 16 at a time
+        for (; len - pos >= 28; pos += 24) {
+                __m256i in = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data + pos))),
+                        _mm_loadu_si128((const __m128i *) (data + pos + 12)), 1);
+                _mm256_storeu_si256((__m256i *) out, encodeLanes(in, urlSafe));
+                out += 32;
         }
+        return pos + encodeSsse3(data + pos, len - pos, out, urlSafe);
+}
 
-        throw ERROR_INVALID_BASE64_CHAR;
+__attribute__((target("avx2")))
+static size_t decodeAvx2(const char *in, size_t len, uint8_t *out) {
+        const __m256i lowLut = _mm256_broadcastsi128_si256(
+                _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                              0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a));
+        const __m256i highLut = _mm256_broadcastsi128_si256(
+                _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+        const __m256i offsets = _mm256_broadcastsi128_si256(
+                _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+        const __m256i pack = _mm256_broadcastsi128_si256(
+                _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        const __m256i slash = _mm256_set1_epi8(0x2f);
+
+        size_t pos = 0;
+        // the two stores cover 28 bytes; 40 chars to go decode to at
+        // least 28 more
+        for (; len - pos >= 40; pos += 32) {
+                __m256i chars = _mm256_loadu_si256((const __m256i *) (in + pos));
+                __m256i highNibbles = _mm256_and_si256(_mm256_srli_epi32(chars, 4), slash);
+                __m256i lowNibbles = _mm256_and_si256(chars, slash);
+                __m256i invalid = _mm256_and_si256(_mm256_shuffle_epi8(lowLut, lowNibbles),
+                                                   _mm256_shuffle_epi8(highLut, highNibbles));
+                if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(invalid, _mm256_setzero_si256())) != 0) {
+                        // let the scalar code say what's wrong with it
+                        return pos;
+                }
+
+                __m256i index = _mm256_add_epi8(_mm256_cmpeq_epi8(chars, slash), highNibbles);
+                __m256i sextets = _mm256_add_epi8(chars, _mm256_shuffle_epi8(offsets, index));
+                __m256i pairs = _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+                __m256i triples = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+                __m256i values = _mm256_shuffle_epi8(triples, pack);
+                _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(values));
+                _mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(values, 1));
+                out += 24;
+        }
+        return pos + decodeSsse3(in + pos, len - pos, out);
 }
 
-// this function operates on 4 char strings
-static void decodeBase64Chunk(const char *str, uint8_t *bytes, bool isLastChunk) {
-        int numBytes = 3;
+static const Codec s_ssse3 = {"ssse3", encodeSsse3, decodeSsse3};
+static const Codec s_avx2 = {"avx2", encodeAvx2, decodeAvx2};
 
-        // Error checking and size adjustment for = char.
-        if (str[0] == '=' || str[1] == '=') {
-                throw ERROR_INVALID_BASE64_CHAR;
+#endif
+
+static const Codec *findCodec(const string &name) {
+        if (name == s_scalar.name) {
+                return &s_scalar;
+        }
+#ifdef BASE64_X86
+        if (name == s_avx2.name && __builtin_cpu_supports("avx2")) {
+                return &s_avx2;
         }
+        if (name == s_ssse3.name && __builtin_cpu_supports("ssse3")) {
+                return &s_ssse3;
+        }
+#endif
+        return NULL;
+}
 
-        // = only allowed in last chunk
-        if (isLastChunk) {
-                if (str[3] == '=') {
-                        if (str[2] == '=') {
-                                numBytes = 1;
-                        } else {
-                                numBytes = 2;
-                        }
-                } else if (str[2] == '=') {
-                        throw ERROR_INVALID_BASE64_CHAR;
-                }
-        } else {
-                if (str[2] == '=' || str[3] == '=') {
-                        throw ERROR_INVALID_BASE64_CHAR;
+/**
+ * The best code this CPU can run
+ */
+static const Codec *bestCodec() {
+        const char *names[] = {"avx2", "ssse3"};
+        for (size_t idx = 0; idx < sizeof(names) / sizeof(names[0]); idx++) {
+                const Codec *found = findCodec(names[idx]);
+                if (found != NULL) {
+                        return found;
                 }
         }
+        return &s_scalar;
+}
 
-        uint32_t bits = 0;
-        bits = getBase64ByteValue(str[0]) << 18 |
-                getBase64ByteValue(str[1]) << 12 |
-                getBase64ByteValue(str[2]) << 6 |
-                getBase64ByteValue(str[3]);
+// what encode() and decode() use, picked the first time they run
+static const Codec *&codec() {
+        static const Codec *codec = bestCodec();
+        return codec;
+}
 
-        bytes[0] = (uint8_t) ((bits & 0x00ff0000) >> 16);
-        if (numBytes >= 2) {
-                bytes[1] = (uint8_t) ((bits & 0x0000ff00) >> 8);
-        }
-        if (numBytes == 3) {
-                bytes[2] = (uint8_t) (bits & 0x000000ff);
+bool Base64::useIsa(const string &name) {
+        const Codec *found = findCodec(name);
+        if (found == NULL) {
+                return false;
         }
+        codec() = found;
+        return true;
 }
 
-static void encodeBase64Chunk(const uint8_t *data, int len, string *ret) {
-        char chunk[5];
-        chunk[4] = '\0';
-        unsigned long bits = 0;
+const char *Base64::isa() {
+        return codec()->name;
+}
 
-        if (len <= 0) {
-                // sanity check, should be impossible to trigger with
-                // public functions
-                throw "invalid chunk size";
+size_t Base64::encode(const uint8_t *data, size_t len, char *out, bool urlSafe) {
+        const char *alphabet = urlSafe ? s_urlAlphabet : s_alphabet;
+        size_t pos = codec()->encodeBlocks(data, len, out, urlSafe);
+        char *dest = out + pos / 3 * 4;
+
+        for (; len - pos >= 3; pos += 3) {
+                uint32_t bits = data[pos] << 16 | data[pos + 1] << 8 | data[pos + 2];
+                dest[0] = alphabet[bits >> 18];
+                dest[1] = alphabet[(bits >> 12) & 0x3f];
+                dest[2] = alphabet[(bits >> 6) & 0x3f];
+                dest[3] = alphabet[bits & 0x3f];
+                dest += 4;
         }
 
-        if (len > 3) {
-                len = 3;
+        if (len - pos > 0) {
+                uint32_t bits = data[pos] << 16;
+                if (len - pos == 2) {
+                        bits |= data[pos + 1] << 8;
+                }
+                dest[0] = alphabet[bits >> 18];
+                dest[1] = alphabet[(bits >> 12) & 0x3f];
+                dest[2] = len - pos == 2 ? alphabet[(bits >> 6) & 0x3f] : '=';
+                dest[3] = '=';
+                dest += 4;
         }
 
-        bits |= data[0] << 16;
-        if (len > 1) {
-                bits |= data[1] << 8;
+        return dest - out;
+}
+
+ssize_t Base64::decode(const char *in, size_t len, uint8_t *out, bool urlSafe) {
+        // padding only tells us what the length already does
+        if (len > 0 && len % 4 == 0 && in[len - 1] == '=') {
+                len -= in[len - 2] == '=' ? 2 : 1;
         }
-        if (len > 2) {
-                bits |= data[2];
+        if (len % 4 == 1) {
+                return -1;
         }
 
-        chunk[4] = '\0';
-        chunk[0] = getBase64CharValue((bits & (0x3f << 18)) >> 18);
-        chunk[1] = getBase64CharValue((bits & (0x3f << 12)) >> 12);
-        if (len == 1) {
-                chunk[2] = '=';
-                chunk[3] = '=';
-        } else {
-                chunk[2] = getBase64CharValue((bits & (0x3f << 6)) >> 6);
-                if (len == 2) {
-                        chunk[3] = '=';
-                } else {
-                        chunk[3] = getBase64CharValue(bits & 0x3f);
+        const signed char *values = urlSafe ? s_urlValues.value : s_values.value;
+        size_t pos = urlSafe ? 0 : codec()->decodeBlocks(in, len, out);
+        uint8_t *dest = out + pos / 4 * 3;
+
+        for (; len - pos >= 4; pos += 4) {
+                int a = values[(unsigned char) in[pos]];
+                int b = values[(unsigned char) in[pos + 1]];
+                int c = values[(unsigned char) in[pos + 2]];
+                int d = values[(unsigned char) in[pos + 3]];
+                if ((a | b | c | d) < 0) {
+                        return -1;
                 }
+                uint32_t bits = a << 18 | b << 12 | c << 6 | d;
+                dest[0] = bits >> 16;
+                dest[1] = bits >> 8;
+                dest[2] = bits;
+                dest += 3;
         }
 
-        *ret += chunk;
+        if (len - pos > 0) {
+                int a = values[(unsigned char) in[pos]];
+                int b = values[(unsigned char) in[pos + 1]];
+                int c = len - pos == 3 ? values[(unsigned char) in[pos + 2]] : 0;
+                if ((a | b | c) < 0) {
+                        return -1;
+                }
+                uint32_t bits = a << 18 | b << 12 | c << 6;
+                *dest++ = bits >> 16;
+                if (len - pos == 3) {
+                        *dest++ = bits >> 8;
+                }
+        }
+
+        return dest - out;
 }
 
 /**
@@ -168,33 +374,18 @@ static void encodeBase64Chunk(const uint8_t *data, int len, string *ret) {
  * which it returns.
  */
 string Base64::bytesToBase64(const uint8_t *data, int len) {
-        string ret;
-
-        ret.reserve(static_cast<int>((len + 3) * 4 / 3));
-        for (int idx = 0; idx < len; idx += 3) {
-                encodeBase64Chunk(data + idx, len - idx, &ret);
-        }
-
+        string ret(encodedLength(len), '\0');
+        encode(data, len, &ret[0]);
         return ret;
 }
 
-string replace_all(string str, string original, string replace) {
-  string::size_type n = 0;
-  while ( (n = str.find(original, n) ) != string::npos ) {
-    str.replace(n, original.size(), replace);
-    n += replace.size();
-  }
-  return str;
-}
-
 /**
  * Same as `bytesToBase64 but makes them URL safe
  */
 string Base64::bytesToBase64UrlSafe(const uint8_t *data, int len) {
-  string ret = bytesToBase64(data, len);
-  ret = replace_all(ret, "+", "-");
-  ret = replace_all(ret, "/", "_");
-  return ret;
+        string ret(encodedLength(len), '\0');
+        encode(data, len, &ret[0], true);
+        return ret;
 }
 
 /**
@@ -206,50 +397,17 @@ uint8_t *Base64::base64ToBytes(string s, int *len) {
         if (s.size() == 0) {
                 return NULL;
         }
-
-        // figure out the number of bytes encoded
-        int rem = s.size() % 4;
-        int size = (s.size() / 4) * 3;
-        if (rem == 0) {
-                // check for padding
-                if (s.at(s.size()-1) == '=') {
-                        if (s.at(s.size()-2) == '=') {
-                                size -= 2;
-                        } else {
-                                size -= 1;
-                        }
-                }
-        } else {
-                // no padding, not divisible by 4, add padding and
-                // adjust size
-                if (rem == 3) {
-                        size += 2;
-                        s += "=";
-                } else if (rem == 2) {
-                        size += 1;
-                        s += "==";
-                } else {
-                        throw ERROR_INVALID_BASE64_STRING_LENGTH;
-                }
+        if (s.size() % 4 == 1) {
+                throw ERROR_INVALID_BASE64_STRING_LENGTH;
         }
 
-        *len = size;
-        uint8_t *bytes = NULL;
-
-        try {
-                bytes = new uint8_t[size];
-                unsigned int byteIdx = 0;
-                for (unsigned int idx = 0; idx < s.size(); idx += 4) {
-                        bool isLastChunk = (idx == (s.size() - 4));
-                        decodeBase64Chunk(s.c_str() + idx, bytes + byteIdx,
-                                          isLastChunk);
-                        byteIdx += 3;
-                }
-        } catch (const char * ex) {
-                if (bytes != NULL)
-                        delete [] bytes;
-                throw ex;
+        uint8_t *bytes = new uint8_t[decodedLength(s.size())];
+        ssize_t size = decode(s.data(), s.size(), bytes);
+        if (size < 0) {
+                delete [] bytes;
+                throw ERROR_INVALID_BASE64_CHAR;
         }
 
+        *len = size;
         return bytes;
 }
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <errno.h>
 #include <string>
 
 #include <iostream>
@@ -12,6 +14,7 @@
 using namespace std;
 
 MySocket::MySocket(const char *inetAddr, int port) {
+  readTimeoutMs = -1;
   call_connect(inetAddr, port);
 }
 
@@ -47,10 +50,12 @@ void MySocket::call_connect(const char *inetAddr, int port) {
 
 MySocket::MySocket(void) {
     sockFd = -1;
+    readTimeoutMs = -1;
 }
 
 MySocket::MySocket(int socketFileDesc) {
     sockFd = socketFileDesc;
+    readTimeoutMs = -1;
 }
 
 MySocket::~MySocket(void) {
@@ -80,19 +85,112 @@ void MySocket::write_bytes(const void *buffer, int len) {
     }
 }
 
+void MySocket::writev(const struct iovec *iov, int iovcnt) {
+    const struct iovec *cur = iov;
+
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    while(iovcnt > 0 && cur->iov_len == 0) {
+        cur++;
+        iovcnt--;
+    }
+
+    while(iovcnt > 0) {
+        ssize_t bytesWritten = ::writev(sockFd, cur, iovcnt);
+        if(bytesWritten <= 0) {
+	  throw SocketWriteError();
+        }
+
+        // skip the buffers that went out completely
+        while(iovcnt > 0 && (size_t) bytesWritten >= cur->iov_len) {
+            bytesWritten -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if(iovcnt == 0) {
+            break;
+        }
+
+        // finish the partially written buffer on its own, then let the
+        // rest go out together again
+        const unsigned char *rest = (const unsigned char *) cur->iov_base + bytesWritten;
+        write_bytes(rest, cur->iov_len - bytesWritten);
+        cur++;
+        iovcnt--;
+    }
+}
+
 string MySocket::read() {
     char buffer[4096];
+    int ret = read_bytes(buffer, sizeof(buffer));
+    return string(buffer, ret);
+}
+
+int MySocket::read_bytes(void *buffer, int len) {
     if(sockFd<0) {
       throw SocketNotConnected();
     }
     
-    int ret = ::read(sockFd, buffer, sizeof(buffer));
+    wait_readable();
+    int ret = ::read(sockFd, buffer, len);
     
     if(ret <= 0) {
       throw SocketReadError();
     }
   
-    return string(buffer, ret);
+    return ret;
+}
+
+void MySocket::setReadTimeout(int ms) {
+    readTimeoutMs = ms;
+}
+
+void MySocket::setWriteTimeout(int ms) {
+    struct timeval tv;
+
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    if(ms < 0) {
+        ms = 0;
+    }
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(sockFd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void MySocket::wait_readable(void) {
+    struct pollfd pfd;
+
+    if(readTimeoutMs < 0) {
+        return;
+    }
+
+    pfd.fd = sockFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret;
+    do {
+        ret = poll(&pfd, 1, readTimeoutMs);
+    } while(ret < 0 && errno == EINTR);
+
+    if(ret == 0) {
+      throw SocketTimeout();
+    }
+    // errors and hangups show up on the read itself
+}
+
+void MySocket::drain(void) {
+    char buffer[4096];
+
+    if(sockFd<0) return;
+
+    ::shutdown(sockFd, SHUT_WR);
+    while(recv(sockFd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+    }
 }
 
 void MySocket::close(void) {
@@ -1,6 +1,8 @@
 #include "StringUtils.h"
 #include "Base64.h"
 
+#include <ctype.h>
+
 #include <openssl/rand.h>
 
 #define ERROR_RUNTIME_ERROR "error_runtime_error"
@@ -77,3 +79,10 @@ vector<string> StringUtils::split(string str, char delimiter) {
 
   return result;
 }
+
+string StringUtils::toLower(string str) {
+  for (size_t idx = 0; idx < str.size(); idx++) {
+    str[idx] = tolower((unsigned char) str[idx]);
+  }
+  return str;
+}
@@ -1,101 +1,282 @@
 #include "WwwFormEncodedDict.h"
-#include "StringUtils.h"
 
-#include <sstream>
+#include <string.h>
 
-#include <stdio.h>
-#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-WwwFormEncodedDict::WwwFormEncodedDict() {
-  // nothing needed
+// hex digit values by byte, -1 for anything that isn't one
+struct HexValues {
+  signed char value[256];
+
+  constexpr HexValues() : value() {
+    for (int idx = 0; idx < 256; idx++) {
+      value[idx] = -1;
+    }
+    for (int idx = 0; idx < 10; idx++) {
+      value['0' + idx] = idx;
+    }
+    for (int idx = 0; idx < 6; idx++) {
+      value['a' + idx] = 10 + idx;
+      value['A' + idx] = 10 + idx;
+    }
+  }
+};
+
+static constexpr HexValues s_hex;
+static const char s_hexDigits[] = "0123456789abcdef";
+
+static bool isSafe(unsigned char c) {
+  return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
 }
 
-WwwFormEncodedDict::WwwFormEncodedDict(string body) {
-  //parse the body
-  vector<string> pairs = StringUtils::split(body, '&');
-  vector<string>::iterator iter;
-  for (iter = pairs.begin(); iter != pairs.end(); iter++) {
-    vector<string> keyValue = StringUtils::split(*iter, '=');
-    if (keyValue.size() != 2) {
-      throw "Parse error";
+// index of the first of `a`, `b` or `c` at or after `pos`, or `len`
+static size_t findAny(const char *in, size_t pos, size_t len, char a, char b, char c) {
+#ifdef __SSE2__
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  const __m128i vc = _mm_set1_epi8(c);
+  for (; pos + 16 <= len; pos += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (in + pos));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+                                _mm_cmpeq_epi8(chunk, vc));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; pos < len; pos++) {
+    if (in[pos] == a || in[pos] == b || in[pos] == c) {
+      break;
     }
+  }
+  return pos;
+}
 
-    string key = urldecode(keyValue[0]);
-    string value = urldecode(keyValue[1]);
-    m_values[key] = value;
+// index of the first byte at or after `pos` that has to be escaped,
+// or `len`
+static size_t findUnsafe(const char *in, size_t pos, size_t len) {
+#ifdef __SSE2__
+  // the compares are signed, so bytes from 0x80 up are below everything
+  const __m128i beforeDigits = _mm_set1_epi8('0' - 1);
+  const __m128i afterDigits = _mm_set1_epi8('9' + 1);
+  const __m128i beforeLetters = _mm_set1_epi8('a' - 1);
+  const __m128i afterLetters = _mm_set1_epi8('z' + 1);
+  const __m128i lowerCase = _mm_set1_epi8(0x20);
+  for (; pos + 16 <= len; pos += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (in + pos));
+    __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeDigits),
+                                   _mm_cmpgt_epi8(afterDigits, chunk));
+    __m128i lower = _mm_or_si128(chunk, lowerCase);
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(lower, beforeLetters),
+                                    _mm_cmpgt_epi8(afterLetters, lower));
+    int mask = ~_mm_movemask_epi8(_mm_or_si128(digits, letters)) & 0xffff;
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; pos < len; pos++) {
+    if (!isSafe(in[pos])) {
+      break;
+    }
   }
+  return pos;
 }
 
-string WwwFormEncodedDict::get(string key) {
-  return m_values[key];
+// decodes the escape at in[pos], which is a '%', into `out`
+static bool decodeEscape(const char *in, size_t pos, size_t len, char *out) {
+  if (len - pos < 3) {
+    return false;
+  }
+  int high = s_hex.value[(unsigned char) in[pos + 1]];
+  int low = s_hex.value[(unsigned char) in[pos + 2]];
+  if (high < 0 || low < 0) {
+    return false;
+  }
+  *out = (char) (high << 4 | low);
+  return true;
 }
 
-void WwwFormEncodedDict::set(string key, string value) {
-  m_values[key] = value;
+ssize_t WwwFormEncodedDict::parse(const char *in, size_t len, char *out, Pairs *pairs) {
+  return parse(in, len, out, [pairs](string_view key, string_view value) {
+      pairs->push_back(make_pair(key, value));
+    });
 }
 
-void WwwFormEncodedDict::set(string key, int value) {
-  stringstream stream;
-  stream << value;
-  m_values[key] = stream.str();
+ssize_t WwwFormEncodedDict::parse(const char *in, size_t len, char *out,
+                                  const function<void(string_view, string_view)> &onPair,
+                                  bool lenient) {
+  size_t pos = 0;
+  size_t written = 0;
+  // where the current pair starts in `in`, and its key and value in `out`
+  size_t pairStart = 0;
+  size_t keyStart = 0;
+  size_t valueStart = 0;
+  bool hasValue = false;
+
+  while (true) {
+    size_t next = findAny(in, pos, len, '%', '&', '=');
+    // once an escape has been decoded `out` is behind `in`, so when
+    // they're the same buffer this is a move; before that it's a no-op
+    if (next > pos && out + written != in + pos) {
+      memmove(out + written, in + pos, next - pos);
+    }
+    written += next - pos;
+    pos = next + 1;
+
+    if (next < len && in[next] == '%') {
+      if (decodeEscape(in, next, len, out + written)) {
+        pos = next + 3;
+      } else if (lenient) {
+        out[written] = '%';
+      } else {
+        return -1;
+      }
+      written++;
+    } else if (next < len && in[next] == '=') {
+      if (!hasValue) {
+        hasValue = true;
+        valueStart = written;
+      } else if (lenient) {
+        out[written++] = '=';
+      } else {
+        return -1;
+      }
+    } else {
+      // the end of a pair, which is either '&' or the end of the body
+      if (next > pairStart) {
+        if (!hasValue && !lenient) {
+          return -1;
+        }
+        if (!hasValue) {
+          valueStart = written;
+        }
+        onPair(string_view(out + keyStart, valueStart - keyStart),
+               string_view(out + valueStart, written - valueStart));
+      }
+      if (next >= len) {
+        break;
+      }
+      pairStart = pos;
+      keyStart = written;
+      hasValue = false;
+    }
+  }
+
+  return written;
 }
 
-string WwwFormEncodedDict::encode() {
-  stringstream output;
-  map<string, string>::iterator iterator;
-  for (iterator = m_values.begin(); iterator != m_values.end(); iterator++) {
-    if (iterator != m_values.begin()) {
-      output << "&";
+void WwwFormEncodedDict::urlencode(string_view str, string *out) {
+  // each byte is at most three once escaped; write straight into the
+  // room for that and trim what wasn't needed at the end
+  size_t written = out->size();
+  out->resize(written + str.size() * 3);
+  char *dest = &(*out)[0];
+
+  size_t pos = 0;
+  while (pos < str.size()) {
+    size_t next = findUnsafe(str.data(), pos, str.size());
+    memcpy(dest + written, str.data() + pos, next - pos);
+    written += next - pos;
+    if (next == str.size()) {
+      break;
+    }
+    unsigned char c = str[next];
+    dest[written++] = '%';
+    dest[written++] = s_hexDigits[c >> 4];
+    dest[written++] = s_hexDigits[c & 0xf];
+    pos = next + 1;
+  }
+  out->resize(written);
+}
+
+bool WwwFormEncodedDict::urldecode(string_view str, string *out) {
+  size_t written = out->size();
+  out->resize(written + str.size());
+  char *dest = &(*out)[0];
+
+  size_t pos = 0;
+  while (pos < str.size()) {
+    size_t next = findAny(str.data(), pos, str.size(), '%', '%', '%');
+    memcpy(dest + written, str.data() + pos, next - pos);
+    written += next - pos;
+    if (next == str.size()) {
+      break;
     }
-    output << urlencode(iterator->first) << "=" << urlencode(iterator->second);
+    if (!decodeEscape(str.data(), next, str.size(), dest + written)) {
+      out->resize(written);
+      return false;
+    }
+    written++;
+    pos = next + 3;
   }
+  out->resize(written);
+  return true;
+}
 
-  return output.str();
+WwwFormEncodedDict::WwwFormEncodedDict() {
+  // nothing needed
 }
 
-string WwwFormEncodedDict::urlencode(std::string str) {
-  string::iterator iterator;
-  stringstream encoded;
-  for (iterator = str.begin(); iterator != str.end(); iterator++) {
-    char c = *iterator;
-    if (isalnum(c)) {
-      encoded << c;
-    } else {
-      char hex[5];
-      snprintf(hex, sizeof(hex), "%%%02x", c);
-      encoded << hex;
+WwwFormEncodedDict::WwwFormEncodedDict(string_view body) {
+  string decoded(body.size(), '\0');
+  Pairs pairs;
+  if (parse(body.data(), body.size(), &decoded[0], &pairs) < 0) {
+    throw "Parse error";
+  }
+
+  m_values.reserve(pairs.size());
+  for (size_t idx = 0; idx < pairs.size(); idx++) {
+    set(string(pairs[idx].first), string(pairs[idx].second));
+  }
+}
+
+string WwwFormEncodedDict::get(string key) {
+  for (size_t idx = 0; idx < m_values.size(); idx++) {
+    if (m_values[idx].first == key) {
+      return m_values[idx].second;
     }
   }
+  return "";
+}
 
-  return encoded.str();
+void WwwFormEncodedDict::set(string key, string value) {
+  // forms are a handful of fields, so looking through them all beats
+  // keeping a tree of them
+  for (size_t idx = 0; idx < m_values.size(); idx++) {
+    if (m_values[idx].first == key) {
+      m_values[idx].second = std::move(value);
+      return;
+    }
+  }
+  m_values.push_back(make_pair(std::move(key), std::move(value)));
 }
 
-string WwwFormEncodedDict::urldecode(std::string str) {
-  vector<string> lines = StringUtils::splitWithDelimiter(str, '%');
-  bool nextStartsWithHex = false;
-  stringstream decoded;
-  
-  vector<string>::iterator iter;
-  for (iter = lines.begin(); iter != lines.end(); iter++) {
-    string line = *iter;
-    if (line == "%") {
-      nextStartsWithHex = true;
-    } else if (nextStartsWithHex) {
-      string hex = line.substr(0, 2);
-      unsigned int digit;
-      int ret = sscanf(hex.c_str(), "%02x", &digit);
-      if (ret != 1) {
-	throw "couldn't parse escaped char";
-      }
-      decoded << (char) digit;
-      decoded << line.substr(2);
-      nextStartsWithHex = false;
-    } else {
-      decoded << line;
+void WwwFormEncodedDict::set(string key, int value) {
+  set(std::move(key), to_string(value));
+}
+
+string WwwFormEncodedDict::encode() {
+  string output;
+  size_t size = 0;
+  for (size_t idx = 0; idx < m_values.size(); idx++) {
+    size += m_values[idx].first.size() + m_values[idx].second.size() + 2;
+  }
+  output.reserve(size * 3);
+
+  for (size_t idx = 0; idx < m_values.size(); idx++) {
+    if (idx > 0) {
+      output.push_back('&');
     }
+    urlencode(m_values[idx].first, &output);
+    output.push_back('=');
+    urlencode(m_values[idx].second, &output);
   }
 
-  return decoded.str();
+  return output;
 }
@@ -2,13 +2,51 @@
 #define _BASE64_H_
 
 #include <stdint.h>
+#include <sys/types.h>
+
 #include <string>
 
+/**
+ * Base64 with padding, in the standard alphabet or the URL safe one
+ * that has '-' and '_' for '+' and '/'.
+ *
+ * encode() and decode() write into the caller's buffer. On x86 they
+ * work through the input 24 or 12 bytes at a time with AVX2 or SSSE3,
+ * whichever the CPU has, and finish the tail with table lookups.
+ */
 class Base64 {
 public:
   static std::string bytesToBase64(const uint8_t *data, int len);
   static std::string bytesToBase64UrlSafe(const uint8_t *data, int len);
+  // the caller delete[]s the result
   static uint8_t *base64ToBytes(std::string s, int *len);
+
+  // how many chars encode() writes for `len` bytes
+  static size_t encodedLength(size_t len) { return (len + 2) / 3 * 4; }
+  // the most bytes decode() can write for `len` chars
+  static size_t decodedLength(size_t len) { return (len + 3) / 4 * 3; }
+
+  /**
+   * Encodes `len` bytes of `data` into the encodedLength(len) chars at
+   * `out`, which isn't NUL terminated, and returns how many that is.
+   */
+  static size_t encode(const uint8_t *data, size_t len, char *out, bool urlSafe = false);
+
+  /**
+   * Decodes `len` chars of `in` into the decodedLength(len) bytes at
+   * `out`. Padding is optional. Returns the number of bytes written, or
+   * -1 if `in` isn't base64, in which case `out` holds garbage.
+   */
+  static ssize_t decode(const char *in, size_t len, uint8_t *out, bool urlSafe = false);
+
+  /**
+   * Switches every caller to the "avx2", "ssse3" or "scalar" code, for
+   * benchmarks and tests. Returns false, changing nothing, if the CPU
+   * can't run it. Not thread safe.
+   */
+  static bool useIsa(const std::string &name);
+  // the code in use, as named for useIsa()
+  static const char *isa();
 };
 
 #endif
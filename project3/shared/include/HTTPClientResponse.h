@@ -2,28 +2,89 @@
 #define HTTP_CLIENT_REQUEST_H_
 
 #include "MySocket.h"
+#include "http_parser.h"
 
 #include "rapidjson/document.h"
 
+#include <functional>
 #include <map>
 #include <string>
 
 class HTTPClientResponse {
  public:
-  HTTPClientResponse(MySocket *sock);    
+  /**
+   * Called with each piece of the body as it arrives, already stripped
+   * of any chunked encoding. Status and headers are available by the
+   * time it's first called.
+   */
+  typedef std::function<void(const char *data, size_t len)> BodySink;
+
+  /**
+   * `buffer`, if given, carries bytes between responses read from the
+   * same connection: on the way in it holds whatever was read past the
+   * end of the previous response, and on the way out whatever was read
+   * past the end of this one. Responses to HEAD requests never have a
+   * body, so the reader has to be told.
+   */
+  HTTPClientResponse(MySocket *sock, std::string *buffer = NULL, bool headRequest = false);
+
+  /**
+   * Sends the body to `sink` instead of keeping it, so a download of
+   * any size only ever holds one read's worth in memory. body() stays
+   * empty. Set it before calling readResponse().
+   */
+  void setBodySink(BodySink sink) { m_sink = sink; }
+
+  /**
+   * Reads one response, parsing it as it arrives. The response is
+   * framed by its Content-Length, its chunked encoding or, failing
+   * both, the connection closing. Returns the body, unless it went to a
+   * sink. Throws SocketReadError if the connection closes before the
+   * response is complete or the response doesn't parse.
+   */
   std::string readResponse();
   int status() { return m_status_code; }
   bool success() { return m_status_code >= 200 && m_status_code < 300; }
   std::string body() { return m_body; }
+
+  /**
+   * Case-insensitive header lookup, "" if the header wasn't sent
+   */
+  std::string header(std::string name);
+
+  // whether the connection can carry another request afterwards
+  bool keepAlive() { return m_keep_alive; }
+  // whether any of the response arrived
+  bool started() { return m_started; }
   // make sure to free the document after you're done with it
   rapidjson::Document *jsonBody();
   
  protected:
+  static int header_field_cb(http_parser *parser, const char *at, size_t length);
+  static int header_value_cb(http_parser *parser, const char *at, size_t length);
+  static int headers_complete_cb(http_parser *parser);
+  static int body_cb(http_parser *parser, const char *at, size_t length);
+  static int message_complete_cb(http_parser *parser);
+
+  bool readMore();
+
   MySocket *m_sock;
+  std::string *m_buffer;
+  std::string m_own_buffer;
+  http_parser_settings m_settings;
+  http_parser m_parser;
+  bool m_head_request;
+  bool m_keep_alive;
+  bool m_started;
+  bool m_done;
+  // header field and value being parsed; either can arrive in pieces
+  std::string m_field;
+  std::string m_value;
+  bool m_in_value;
+  BodySink m_sink;
   std::string m_body;
   std::map<std::string, std::string> m_headers;
   int m_status_code;
-  std::string m_status_message;
 };
 
 #endif
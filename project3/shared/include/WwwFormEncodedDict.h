@@ -1,29 +1,60 @@
 #ifndef _WWW_FORM_ENCODED_DICT_H_
 #define _WWW_FORM_ENCODED_DICT_H_
 
+#include <sys/types.h>
+
+#include <functional>
 #include <string>
-#include <map>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 class WwwFormEncodedDict {
  public:
+  // decoded keys and values, in the order they were sent
+  typedef std::vector<std::pair<std::string_view, std::string_view> > Pairs;
+
   WwwFormEncodedDict();
-  WwwFormEncodedDict(std::string body);
-  
+  // throws "Parse error" if the body isn't form encoded
+  WwwFormEncodedDict(std::string_view body);
+
   std::string get(std::string key);
   void set(std::string key, std::string value);
   void set(std::string key, int value);
-  
+
   std::string encode();
 
- protected:
-  std::string urlencode(std::string str);
-  std::string urldecode(std::string str);
-  std::vector<std::string> split(std::string str, char delimiter);
-  std::vector<std::string> splitWithDelimiter(std::string str, char delimiter);
-  
+  /**
+   * Decodes `len` bytes of form encoded `in` into `out` in a single
+   * pass, and appends views into `out` of each key and value to
+   * `pairs`. `out` needs room for `len` bytes, which is as long as the
+   * decoded form can be, and may be `in` itself to decode in place.
+   * Empty pairs are skipped; a repeated key appears each time it was
+   * sent.
+   *
+   * Returns the number of bytes written, or -1 if a pair doesn't have
+   * exactly one '=' or an escape isn't two hex digits, in which case
+   * `out` and `pairs` hold whatever had been decoded so far.
+   */
+  static ssize_t parse(const char *in, size_t len, char *out, Pairs *pairs);
+
+  /**
+   * The same, handing each pair to `onPair` as it's decoded. With
+   * `lenient` nothing is an error, which suits query strings: a pair
+   * without '=' has an empty value, any '=' after the first is part of
+   * the value, and a '%' that doesn't start an escape is kept as is.
+   */
+  static ssize_t parse(const char *in, size_t len, char *out,
+                       const std::function<void(std::string_view, std::string_view)> &onPair,
+                       bool lenient = false);
+
+  // percent-encodes every byte but letters and digits onto the end of `out`
+  static void urlencode(std::string_view str, std::string *out);
+  // decodes `str` onto the end of `out`; false for a bad escape
+  static bool urldecode(std::string_view str, std::string *out);
+
  private:
-  std::map<std::string, std::string> m_values;
+  std::vector<std::pair<std::string, std::string> > m_values;
 };
-  
+
 #endif
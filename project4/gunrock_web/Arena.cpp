@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Arena.h"
+
+using namespace std;
+
+// how many regular sized blocks to keep between requests; oversized
+// blocks are always freed so one huge upload doesn't pin its memory for
+// the life of the worker
+#define MAX_KEPT_BLOCKS 4
+
+Arena::Arena(size_t blockSize) {
+  m_blockSize = blockSize;
+  m_blocks = NULL;
+  m_free = NULL;
+  m_ptr = NULL;
+  m_end = NULL;
+  m_finalizers = NULL;
+}
+
+Arena::~Arena() {
+  reset();
+  while (m_free != NULL) {
+    Block *next = m_free->next;
+    free(m_free);
+    m_free = next;
+  }
+}
+
+void *Arena::allocate(size_t size, size_t align) {
+  uintptr_t ptr = ((uintptr_t) m_ptr + align - 1) & ~(uintptr_t) (align - 1);
+  if (m_ptr == NULL || ptr + size > (uintptr_t) m_end) {
+    return allocateSlow(size, align);
+  }
+  m_ptr = (char *) (ptr + size);
+  return (void *) ptr;
+}
+
+void *Arena::allocateSlow(size_t size, size_t align) {
+  size_t needed = size + align;
+  Block *block = NULL;
+
+  // reuse a kept block if it's big enough
+  if (m_free != NULL && m_free->size >= needed) {
+    block = m_free;
+    m_free = block->next;
+  } else {
+    size_t blockSize = m_blockSize;
+    if (needed > blockSize) {
+      blockSize = needed;
+    }
+    block = (Block *) malloc(sizeof(Block) + blockSize);
+    if (block == NULL) {
+      throw bad_alloc();
+    }
+    block->size = blockSize;
+  }
+
+  block->next = m_blocks;
+  m_blocks = block;
+  m_ptr = blockData(block);
+  m_end = m_ptr + block->size;
+  return allocate(size, align);
+}
+
+void Arena::addFinalizer(void (*fn)(void *), void *obj) {
+  Finalizer *finalizer = (Finalizer *) allocate(sizeof(Finalizer), alignof(Finalizer));
+  finalizer->fn = fn;
+  finalizer->obj = obj;
+  finalizer->next = m_finalizers;
+  m_finalizers = finalizer;
+}
+
+void Arena::reset() {
+  while (m_finalizers != NULL) {
+    Finalizer *finalizer = m_finalizers;
+    m_finalizers = finalizer->next;
+    finalizer->fn(finalizer->obj);
+  }
+
+  // move the used blocks back to the free list
+  int kept = 0;
+  for (Block *block = m_free; block != NULL; block = block->next) {
+    kept++;
+  }
+  while (m_blocks != NULL) {
+    Block *block = m_blocks;
+    m_blocks = block->next;
+    if (block->size == m_blockSize && kept < MAX_KEPT_BLOCKS) {
+      block->next = m_free;
+      m_free = block;
+      kept++;
+    } else {
+      free(block);
+    }
+  }
+
+  m_ptr = NULL;
+  m_end = NULL;
+}
@@ -19,6 +19,11 @@ DistributedFileSystemService::DistributedFileSystemService(string diskFile) : Ht
   this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
 }  
 
+DistributedFileSystemService::~DistributedFileSystemService() {
+  delete this->fileSystem->disk;
+  delete this->fileSystem;
+}
+
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
   response->setBody("");
 }
@@ -5,9 +5,13 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 using namespace std;
 
+#define EMPTY_SLOT 0xffff
+#define INITIAL_RECV_BUFFER_SIZE 4096
+
 
 /***************************** HTTP Parser callbacks ************************/
 
@@ -22,20 +26,20 @@ int HTTP::message_begin_cb(http_parser *parser)
 int HTTP::path_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_path.append(at, length);
+    http->extend(&http->m_path, at, length);
     return 0;
 }
 int HTTP::query_string_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_query.append(at, length);
+    http->extend(&http->m_query, at, length);
     return 0;
 }
 
 int HTTP::url_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->appendUrl(at, length);
+    http->extend(&http->m_url, at, length);
 
     return 0;
 }
@@ -52,7 +56,7 @@ int HTTP::header_field_cb(http_parser *parser, const char *at, size_t length)
     HTTP *http = (HTTP *) parser->data;
 
     if(http->getState() == HTTP::FIELD) {
-        http->appendHeaderField(at, length);
+        http->extend(&http->m_headers.back().first, at, length);
     } else if((http->getState() == HTTP::VALUE) ||
               (http->getState() == HTTP::HEADER)) {
         http->newHeaderField(at, length);
@@ -71,16 +75,20 @@ int HTTP::header_value_cb(http_parser *parser, const char *at, size_t length)
         http->setState(HTTP::VALUE);
     }
     assert(http->getState() == HTTP::VALUE);
-    http->appendHeaderValue(at, length);
+    http->extend(&http->m_headers.back().second, at, length);
     return 0;
 }
 
 int HTTP::headers_complete_cb(http_parser *parser)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->addHeaderField();
+    http->indexHeaders();
     http->m_headerDone = true;
 
+    // the last thing before the blank line that ends the headers
+    const Span &last = http->m_headers.empty() ? http->m_url : http->m_headers.back().second;
+    http->m_headerLength = last.offset + last.length;
+
     if(http->m_httpType == HTTP_RESPONSE) {
         char buf[64];
         snprintf(buf, 63, "HTTP/%u.%u %u ", parser->http_major, parser->http_minor, parser->status_code);
@@ -119,7 +127,7 @@ int HTTP::headers_complete_cb(http_parser *parser)
 int HTTP::body_cb(http_parser *parser, const char *at, size_t length)
 {
     HTTP *http = (HTTP *) parser->data;
-    http->m_body.append(at, length);
+    http->appendBody(at, length);
 
     return 0;
 }
@@ -141,7 +149,10 @@ int HTTP::message_complete_cb(http_parser *parser)
 /*************************** Public Functions *******************************/
 
 
-HTTP::HTTP(http_parser_type httpType)
+HTTP::HTTP(http_parser_type httpType, Arena *arena)
+    : m_raw(ArenaAllocator<char>(arena)),
+      m_headers(ArenaAllocator< pair<Span, Span> >(arena)),
+      m_headerIndex(ArenaAllocator<uint16_t>(arena))
 {
     m_state = INIT;
     http_parser_init(&m_parser, httpType);
@@ -162,56 +173,93 @@ HTTP::HTTP(http_parser_type httpType)
 
     m_parser.data = this;
 
-    m_field = NULL;
-    m_value = NULL;
+    m_rawUsed = 0;
+    m_rawParsed = 0;
+    m_headers.reserve(32);
+    m_url.offset = m_url.length = 0;
+    m_path = m_query = m_url;
+    m_authToken = m_url;
+    m_body = m_url;
+    m_hasAuthToken = false;
+    m_headerLength = 0;
     m_extraParsedBytes = 0;
 }
 
 HTTP::~HTTP()
 {
-    if(m_field != NULL) {
-        delete m_field;
-    }
-
-    if(m_value != NULL) {
-        delete m_value;
-    }
+}
 
-    for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        delete m_headers[idx].first;
-        delete m_headers[idx].second;
+char *HTTP::recvBuffer(size_t len)
+{
+    if(m_raw.size() - m_rawUsed < len) {
+        size_t size = m_raw.size() > 0 ? m_raw.size() : INITIAL_RECV_BUFFER_SIZE;
+        while(size - m_rawUsed < len) {
+            size *= 2;
+        }
+        m_raw.resize(size);
     }
+    return &m_raw[m_rawUsed];
 }
 
-int HTTP::addData(const unsigned char *data, int len)
+int HTTP::addReceived(size_t len)
 {
     if(m_doneParsing) {
         assert(false);
     }
-    int ret = http_parser_execute(&m_parser, &m_settings, (const char *) data, len);
+    assert(m_rawUsed + len <= m_raw.size());
+    m_rawUsed += len;
+
+    // the parser only sees the new bytes, but everything it hands back
+    // to the callbacks lives in m_raw so the spans stay contiguous
+    int ret = http_parser_execute(&m_parser, &m_settings, m_raw.data() + m_rawParsed,
+                                  m_rawUsed - m_rawParsed);
     ret += m_extraParsedBytes;
     m_extraParsedBytes = 0;
+    m_rawParsed += ret;
+    return ret;
+}
+
+int HTTP::addData(const unsigned char *data, int len)
+{
+    memcpy(recvBuffer(len), data, len);
+    int ret = addReceived(len);
+    // callers resubmit whatever wasn't consumed
+    m_rawUsed = m_rawParsed;
     return ret;
 }
 
 string HTTP::getBody()
 {
-    return m_body;
+    return string(getBodyView());
+}
+
+char *HTTP::getBodyInsitu()
+{
+    if(m_body.length == 0) {
+        m_body.offset = m_rawUsed;
+    }
+    // whatever follows the body has been parsed already; at the very
+    // end of the buffer this is the string's own terminator
+    size_t end = m_body.offset + m_body.length;
+    if(end < m_raw.size()) {
+        m_raw[end] = '\0';
+    }
+    return &m_raw[m_body.offset];
 }
 
 string HTTP::getUrl()
 {
-    return m_url;
+    return string(getUrlView());
 }
 
 string HTTP::getPath()
 {
-    return m_path;
+    return string(getPathView());
 }
 
 string HTTP::getHost()
 {
-    string host = (m_method == HTTP_CONNECT) ? m_url : m_host;
+    string host = (m_method == HTTP_CONNECT) ? getUrl() : m_host;
     if(host.find(':') == string::npos) {
         host += ":80";
     }
@@ -239,8 +287,8 @@ string HTTP::getReplyHeader()
 
     bool foundConn = false;
     for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        string field = *(m_headers[idx].first);
-        string value = *(m_headers[idx].second);
+        string field(headerField(idx));
+        string value(headerValue(idx));
 
         if(field == "Connection") {
             value = "close";
@@ -263,24 +311,27 @@ string HTTP::getProxyRequest(const char *userAgent)
 {
     string reply;
     string urlPathQuery;
+    string url = getUrl();
+    string path = getPath();
+    string query = getQuery();
 
     assert(m_httpType == HTTP_REQUEST);
 
     if((m_method == HTTP_GET) || (m_method == HTTP_POST) || (m_method == HTTP_HEAD)) {
-        if(m_path.size() == 0) {
+        if(path.size() == 0) {
             urlPathQuery = "/";
         } else {
-            urlPathQuery = m_path;
+            urlPathQuery = path;
         }
-        if(m_query.size() > 0) {
-            urlPathQuery += "?" + m_query;
+        if(query.size() > 0) {
+            urlPathQuery += "?" + query;
         }
-        if(m_url.find(urlPathQuery) == string::npos) {
+        if(url.find(urlPathQuery) == string::npos) {
             // this is a hack to get around buggy HTML from taobao
-            assert(m_query.size() > 0);
-            urlPathQuery = m_path + "??" + m_query;
-            if(m_url.find(urlPathQuery) == string::npos) {
-                cout << "url path mismatch " << m_url << endl << urlPathQuery << endl;
+            assert(query.size() > 0);
+            urlPathQuery = path + "??" + query;
+            if(url.find(urlPathQuery) == string::npos) {
+                cout << "url path mismatch " << url << endl << urlPathQuery << endl;
             }
         }
     }
@@ -288,7 +339,7 @@ string HTTP::getProxyRequest(const char *userAgent)
     if(m_method == HTTP_GET) {
         reply = "GET " + urlPathQuery + " HTTP/1.1\r\n";
     } else if(m_method == HTTP_CONNECT) {
-        reply = "CONNECT " + m_url + " HTTP/1.1\r\n";
+        reply = "CONNECT " + url + " HTTP/1.1\r\n";
     } else if(m_method == HTTP_POST) {
         reply = "POST " + urlPathQuery + " HTTP/1.1\r\n";
     } else if(m_method == HTTP_HEAD) {
@@ -298,8 +349,8 @@ string HTTP::getProxyRequest(const char *userAgent)
     }
 
     for(unsigned int idx = 0; idx < m_headers.size(); idx++) {
-        string field = *(m_headers[idx].first);
-        string value = *(m_headers[idx].second);
+        string field(headerField(idx));
+        string value(headerValue(idx));
 
         if((userAgent != NULL) && (field == "User-Agent")) {
             value = string(userAgent);
@@ -317,8 +368,8 @@ string HTTP::getProxyRequest(const char *userAgent)
     }
 
     reply += string("\r\n");
-    if(m_body.size() > 0) {
-        reply += m_body;
+    if(m_body.length > 0) {
+        reply += getBodyView();
     }
 
     if(m_method == HTTP_HEAD) {
@@ -345,44 +396,113 @@ void HTTP::setState(HttpState newState)
     m_state = newState;
 }
 
-void HTTP::appendUrl(const char *at, size_t len)
+void HTTP::extend(Span *span, const char *at, size_t len)
 {
-    m_url.append(at, len);
+    uint32_t offset = at - m_raw.data();
+    if(span->length == 0) {
+        span->offset = offset;
+    } else {
+        // callbacks for one token always continue where the last left off
+        assert(span->offset + span->length == offset);
+    }
+    span->length += len;
 }
 
-void HTTP::addHeaderField()
+void HTTP::appendBody(const char *at, size_t len)
 {
-    if(m_field != NULL) {
-        assert(m_value != NULL);
-        if(*m_field == "Host") {
-            m_host = *m_value;
-        }
-        if(*m_field == "Eoh") {
-            cout << "got the Eoh header" << endl;
-        }
-        m_headers.insert(m_headers.end(), pair<string *, string *>(m_field, m_value));
-        m_field = NULL;
-        m_value = NULL;
-    } else {
-        assert(m_value == NULL);
+    uint32_t offset = at - m_raw.data();
+    if(m_body.length == 0) {
+        m_body.offset = offset;
+    } else if(m_body.offset + m_body.length != offset) {
+        // the next chunk of a chunked body: slide it down over the chunk
+        // header in between, which the parser is done with, so the body
+        // stays in one piece without being copied out of the buffer
+        memmove(&m_raw[m_body.offset + m_body.length], at, len);
     }
+    m_body.length += len;
 }
 
 void HTTP::newHeaderField(const char *at, size_t len)
 {
-    addHeaderField();
-    m_field = new string(at, len);
-    m_value = new string();
+    Span empty = {0, 0};
+    m_headers.push_back(pair<Span, Span>(empty, empty));
+    extend(&m_headers.back().first, at, len);
 }
-void HTTP::appendHeaderField(const char *at, size_t len)
+
+uint32_t HTTP::hashField(string_view field)
 {
-    assert(m_field != NULL);
-    m_field->append(at, len);
+    // FNV-1a over the lower-cased name
+    uint32_t hash = 2166136261u;
+    for(size_t idx = 0; idx < field.size(); idx++) {
+        unsigned char c = field[idx];
+        if(c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+void HTTP::indexHeaders()
+{
+    size_t slots = 16;
+    while(slots < m_headers.size() * 2) {
+        slots *= 2;
+    }
+    assert(m_headers.size() < EMPTY_SLOT);
+    m_headerIndex.assign(slots, EMPTY_SLOT);
+
+    for(size_t idx = 0; idx < m_headers.size(); idx++) {
+        string_view field = headerField(idx);
+        size_t slot = hashField(field) & (slots - 1);
+        bool duplicate = false;
+        while(m_headerIndex[slot] != EMPTY_SLOT) {
+            string_view other = headerField(m_headerIndex[slot]);
+            if(other.size() == field.size() &&
+               strncasecmp(other.data(), field.data(), field.size()) == 0) {
+                // repeated header, the first one wins
+                duplicate = true;
+                break;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+        if(!duplicate) {
+            m_headerIndex[slot] = idx;
+        }
+    }
+
+    string_view host;
+    if(findHeader("Host", &host)) {
+        m_host = string(host);
+    }
+
+    // every authenticated call wants this, so look it up just once
+    string_view token;
+    m_hasAuthToken = findHeader("x-auth-token", &token);
+    if(m_hasAuthToken) {
+        m_authToken.offset = token.data() - m_raw.data();
+        m_authToken.length = token.size();
+    }
 }
 
-void HTTP::appendHeaderValue(const char *at, size_t len)
+bool HTTP::findHeader(string_view field, string_view *value)
 {
-    m_value->append(at, len);
+    if(m_headerIndex.empty()) {
+        return false;
+    }
+
+    size_t mask = m_headerIndex.size() - 1;
+    size_t slot = hashField(field) & mask;
+    while(m_headerIndex[slot] != EMPTY_SLOT) {
+        string_view candidate = headerField(m_headerIndex[slot]);
+        if(candidate.size() == field.size() &&
+           strncasecmp(candidate.data(), field.data(), field.size()) == 0) {
+            *value = headerValue(m_headerIndex[slot]);
+            return true;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return false;
 }
 
 void HTTP::messageComplete(unsigned char method)
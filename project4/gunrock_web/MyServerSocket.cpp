@@ -1,6 +1,9 @@
 #include "MyServerSocket.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -32,19 +35,54 @@ MyServerSocket::MyServerSocket(int port)
     
     //set up a listen queue
     listen(serverFd, 10);
+    // accept waits in poll instead, so it can be woken up
+    fcntl(serverFd, F_SETFL, O_NONBLOCK);
 }
 
-MySocket *MyServerSocket::accept()
+MyServerSocket *MyServerSocket::fromFd(int fd)
+{
+    MyServerSocket *server = new MyServerSocket();
+    server->serverFd = fd;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return server;
+}
+
+void MyServerSocket::close()
+{
+    if (serverFd >= 0) {
+      ::close(serverFd);
+      serverFd = -1;
+    }
+}
+
+MySocket *MyServerSocket::accept(int wakeFd)
 {
     //check that the sockFd is valid
     
     struct sockaddr_in client;
-    socklen_t len = sizeof(client);
-    int clientFd = ::accept(serverFd, (struct sockaddr *) &client, &len);
-    
-    if(clientFd<0) {
-      throw SocketError("accept error");
+    struct pollfd fds[2];
+    fds[0].fd = serverFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeFd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+      socklen_t len = sizeof(client);
+      // client sockets shouldn't leak into a process we exec
+      int clientFd = ::accept4(serverFd, (struct sockaddr *) &client, &len, SOCK_CLOEXEC);
+      if (clientFd >= 0) {
+        return new MySocket(clientFd);
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+        throw SocketError("accept error");
+      }
+
+      // nothing to accept yet, or someone else got it first
+      if (poll(fds, wakeFd >= 0 ? 2 : 1, -1) < 0 && errno != EINTR) {
+        throw SocketError("accept error");
+      }
+      if (wakeFd >= 0 && (fds[1].revents & POLLIN)) {
+        return NULL;
+      }
     }
-    
-    return new MySocket(clientFd);
 }
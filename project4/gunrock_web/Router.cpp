@@ -0,0 +1,117 @@
+#include "Router.h"
+
+using namespace std;
+
+#define NUM_METHODS (sizeof(m_handlers) / sizeof(m_handlers[0]))
+
+Router::Router() {
+  m_root = new Node();
+  m_root->service = NULL;
+
+  for (size_t idx = 0; idx < NUM_METHODS; idx++) {
+    m_handlers[idx] = NULL;
+  }
+  m_handlers[HTTP_HEAD] = &HttpService::head;
+  m_handlers[HTTP_GET] = &HttpService::get;
+  m_handlers[HTTP_PUT] = &HttpService::put;
+  m_handlers[HTTP_POST] = &HttpService::post;
+  m_handlers[HTTP_DELETE] = &HttpService::del;
+  m_handlers[HTTP_MOVE] = &HttpService::move;
+}
+
+Router::~Router() {
+  deleteNode(m_root);
+}
+
+void Router::deleteNode(Node *node) {
+  for (size_t idx = 0; idx < node->children.size(); idx++) {
+    deleteNode(node->children[idx]);
+  }
+  delete node;
+}
+
+void Router::addService(HttpService *service) {
+  string prefix = service->pathPrefix();
+  insert(m_root, prefix, service);
+}
+
+void Router::insert(Node *node, string_view prefix, HttpService *service) {
+  while (!prefix.empty()) {
+    Node *child = NULL;
+    size_t childIdx;
+    for (childIdx = 0; childIdx < node->children.size(); childIdx++) {
+      if (node->children[childIdx]->label[0] == prefix[0]) {
+        child = node->children[childIdx];
+        break;
+      }
+    }
+
+    if (child == NULL) {
+      // nothing shares a first byte with the rest of the prefix
+      child = new Node();
+      child->label = string(prefix);
+      child->service = service;
+      node->children.push_back(child);
+      return;
+    }
+
+    size_t common = 0;
+    while (common < child->label.size() && common < prefix.size() &&
+           child->label[common] == prefix[common]) {
+      common++;
+    }
+
+    if (common < child->label.size()) {
+      // the prefix ends or branches off partway down this edge, so
+      // split it at that point
+      Node *middle = new Node();
+      middle->label = child->label.substr(0, common);
+      middle->service = NULL;
+      middle->children.push_back(child);
+      child->label.erase(0, common);
+      node->children[childIdx] = middle;
+      child = middle;
+    }
+
+    node = child;
+    prefix.remove_prefix(common);
+  }
+
+  // earlier registrations take precedence
+  if (node->service == NULL) {
+    node->service = service;
+  }
+}
+
+HttpService *Router::findService(string_view path) {
+  Node *node = m_root;
+  HttpService *best = node->service;
+
+  while (!path.empty()) {
+    Node *next = NULL;
+    for (size_t idx = 0; idx < node->children.size(); idx++) {
+      if (node->children[idx]->label[0] == path[0]) {
+        next = node->children[idx];
+        break;
+      }
+    }
+    if (next == NULL || path.substr(0, next->label.size()) != next->label) {
+      break;
+    }
+
+    path.remove_prefix(next->label.size());
+    node = next;
+    if (node->service != NULL) {
+      best = node->service;
+    }
+  }
+
+  return best;
+}
+
+Router::Handler Router::findHandler(http_method method) {
+  if ((size_t) method >= NUM_METHODS) {
+    return NULL;
+  }
+  return m_handlers[method];
+}
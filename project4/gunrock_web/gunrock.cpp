@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include <iostream>
 #include <memory>
@@ -15,9 +16,12 @@
 #include "HTTPRequest.h"
 #include "HTTPResponse.h"
 #include "HttpService.h"
+#include "Router.h"
 #include "HttpUtils.h"
+#include "Arena.h"
 #include "FileService.h"
 #include "DistributedFileSystemService.h"
+#include "HotReload.h"
 #include "MySocket.h"
 #include "MyServerSocket.h"
 #include "dthread.h"
@@ -29,45 +33,61 @@ int BUFFER_SIZE = 1;
 string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
+/// Give up on a client that stops reading the response for this long
+int WRITE_TIMEOUT_MS = 30 * 1000;
 string DISKFILE = "disk.img";
+/// How long SIGTERM gives the request in progress before exiting
+/// anyway, in milliseconds (`-D`)
+int DRAIN_TIMEOUT_MS = 30 * 1000;
+/// How long SIGHUP waits for the new process to start accepting
+#define RELOAD_TIMEOUT_MS 10000
 
-vector<HttpService *> services;
+/// The signal handler writes each signal it gets here, which wakes up
+/// the accept in main
+int signal_pipe[2];
 
-HttpService *find_service(HTTPRequest *request) {
-   // find a service that is registered for this path prefix
-  for (unsigned int idx = 0; idx < services.size(); idx++) {
-    if (request->getPath().find(services[idx]->pathPrefix()) == 0) {
-      return services[idx];
-    }
+void on_signal(int sig) {
+  if (sig == SIGTERM) {
+    // if the request in progress doesn't finish in time, SIGALRM ends
+    // us anyway
+    alarm((DRAIN_TIMEOUT_MS + 999) / 1000);
+  }
+  unsigned char byte = sig;
+  if (write(signal_pipe[1], &byte, 1) < 0) {
+    // the pipe is full of signals main hasn't looked at yet
   }
+}
 
-  return NULL;
+/// The request in progress outlasted DRAIN_TIMEOUT_MS. Die of SIGALRM
+/// as before, but with the trace lines written out first
+void on_alarm(int sig) {
+  flush_log();
+  signal(sig, SIG_DFL);
+  raise(sig);
 }
 
+Router router;
+
+HttpService *find_service(HTTPRequest *request) {
+  return router.findService(request->getPathView());
+}
 
-void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
-  stringstream payload;
 
+void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPResponse *response) {
   try {
     // invoke the service if we found one
     if (service == NULL) {
       // not found status
       response->setStatus(404);
-    } else if (request->isHead()) {
-      service->head(request, response);
-    } else if (request->isGet()) {
-      service->get(request, response);
-    } else if (request->isPut()) {
-      service->put(request, response);
-    } else if (request->isPost()) {
-      service->post(request, response);
-    } else if (request->isDelete()) {
-      service->del(request, response);
-    } else if (request->isMove()) {
-      service->move(request, response);
-    } else {
+      return;
+    }
+
+    Router::Handler handler = router.findHandler(request->getMethod());
+    if (handler == NULL) {
       // The server doesn't know about this method
       response->setStatus(501);
+    } else {
+      (service->*handler)(request, response);
     }
   } catch (ClientError &ce) {
     response->setStatus(ce.status_code);
@@ -78,27 +98,54 @@ void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPRespo
   }
 }
 
-void handle_request(MySocket *client) {
-  HTTPRequest *request = new HTTPRequest(client, PORT);
-  HTTPResponse *response = new HTTPResponse();
+/// Send `response` as the last thing on `client`, then stop reading
+/// from it. A client that's already gone is ignored
+void send_final_response(MySocket *client, HTTPResponse *response) {
+  response->setHeader("Connection", "close");
+  try {
+    response->send(client);
+    client->drain();
+  } catch (...) {
+    // the client is gone already, nothing to tell it
+  }
+}
+
+void handle_request(MySocket *client, Arena *arena) {
+  // both live in the worker's arena and go away with it at the end
+  HTTPRequest *request = arena->create<HTTPRequest>(client, PORT, arena);
+  HTTPResponse *response = arena->create<HTTPResponse>();
   stringstream payload;
+
+  client->setWriteTimeout(WRITE_TIMEOUT_MS);
   
   // read in the request
   bool readResult = false;
+  int errorStatus = 0;
   try {
-    payload << "client: " << (void *) client;
+    // only the traced build needs the payload strings
+    if (DTHREAD_TRACING) {
+      payload << "client: " << (void *) client;
+    }
     sync_print("read_request_enter", payload.str());
     readResult = request->readRequest();
     sync_print("read_request_return", payload.str());
+  } catch (ClientError &ce) {
+    // too slow, too big or not HTTP; tell the client which
+    errorStatus = ce.status_code;
   } catch (...) {
     // swallow it
   }    
     
   if (!readResult) {
     // there was a problem reading in the request, bail
-    delete response;
-    delete request;
+    if (errorStatus != 0) {
+      response->setStatus(errorStatus);
+      send_final_response(client, response);
+    }
+    arena->reset();
     sync_print("read_request_error", payload.str());
+    client->close();
+    delete client;
     return;
   }
   
@@ -110,14 +157,19 @@ void handle_request(MySocket *client) {
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
   cout << payload.str() << endl;
-  client->write(response->response());
+  try {
+    response->send(client);
+  } catch (...) {
+    // the client went away or stopped reading, nothing left to do
+  }
     
-  delete response;
-  delete request;
+  arena->reset();
 
-  payload.str(""); payload.clear();
-  payload << " client: " << (void *) client;
-  sync_print("close_connection", payload.str());
+  if (DTHREAD_TRACING) {
+    payload.str(""); payload.clear();
+    payload << " client: " << (void *) client;
+    sync_print("close_connection", payload.str());
+  }
   client->close();
   delete client;
 }
@@ -127,7 +179,7 @@ int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:I:H:B:W:m:M:D:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -144,14 +196,36 @@ int main(int argc, char *argv[]) {
     case 's':
       SCHEDALG = string(optarg);
       break;
+    case 'I':
+      HTTPRequest::limits.idleTimeoutMs = atoi(optarg);
+      break;
+    case 'H':
+      HTTPRequest::limits.headerTimeoutMs = atoi(optarg);
+      break;
+    case 'B':
+      HTTPRequest::limits.bodyTimeoutMs = atoi(optarg);
+      break;
+    case 'W':
+      WRITE_TIMEOUT_MS = atoi(optarg);
+      break;
+    case 'm':
+      HTTPRequest::limits.maxHeaderBytes = atol(optarg);
+      break;
+    case 'M':
+      HTTPRequest::limits.maxBodyBytes = atol(optarg);
+      break;
     case 'l':
       LOGFILE = string(optarg);
       break;
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'D':
+      DRAIN_TIMEOUT_MS = atoi(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile] [-D drain_ms]"
+          << " [-I idle_ms] [-H header_ms] [-B body_ms] [-W write_ms] [-m max_header_bytes] [-M max_body_bytes]" << endl;
       exit(1);
     }
   }
@@ -161,18 +235,84 @@ int main(int argc, char *argv[]) {
   cout << "Lisening on port " << PORT << endl;
   
   sync_print("init", "");
-  MyServerSocket *server = new MyServerSocket(PORT);
+  // a reload hands us the socket the old process was listening on
+  vector<int> inherited = HotReload::inheritedFds();
+  MyServerSocket *server = inherited.empty() ? new MyServerSocket(PORT) : MyServerSocket::fromFd(inherited[0]);
+  for (size_t idx = 1; idx < inherited.size(); idx++) {
+    close(inherited[idx]);
+  }
   MySocket *client;
 
-  // The order that you push services dictates the search order
-  // for path prefix matching
+  if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    cerr << "failed to create pipe" << endl;
+    return 1;
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGHUP, &action, NULL);
+  action.sa_handler = on_alarm;
+  sigaction(SIGALRM, &action, NULL);
+  // a reload starts us with these blocked, so anything sent before the
+  // handlers were in place is delivered now
+  sigset_t handled;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGHUP);
+  sigprocmask(SIG_UNBLOCK, &handled, NULL);
+
+  // Requests go to the service with the longest matching path prefix;
+  // for identical prefixes the first one added wins
+  vector<HttpService *> services;
   services.push_back(new DistributedFileSystemService(DISKFILE));
   services.push_back(new FileService(BASEDIR));
-  
-  while(true) {
+  for (size_t idx = 0; idx < services.size(); idx++) {
+    router.addService(services[idx]);
+  }
+
+  // if we replaced an older process, it can stop accepting now
+  HotReload::ready();
+
+  // SIGTERM lets the request in progress finish and exits. SIGHUP
+  // starts a new copy of the binary on the same socket first, so no
+  // connection is refused while we switch
+  Arena arena;
+  bool stopping = false;
+  while(!stopping) {
+    // accept() only looks at the pipe once the backlog is empty, so
+    // check it first or a steady stream of clients would keep us here
+    unsigned char sig;
+    while (read(signal_pipe[0], &sig, 1) == 1) {
+      if (sig == SIGTERM) {
+        stopping = true;
+      } else if (sig == SIGHUP && !stopping) {
+        vector<int> fds(1, server->getFd());
+        if (HotReload::reexec(argv, fds, RELOAD_TIMEOUT_MS)) {
+          stopping = true;
+        } else {
+          cerr << "reload failed, still serving" << endl;
+        }
+      }
+    }
+    if (stopping) {
+      break;
+    }
+
     sync_print("waiting_to_accept", "");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    handle_request(client);
+    client = server->accept(signal_pipe[0]);
+    if (client != NULL) {
+      sync_print("client_accepted", "");
+      handle_request(client, &arena);
+    }
+  }
+  // the request in progress finished in time
+  alarm(0);
+  server->close();
+  delete server;
+  for (size_t idx = 0; idx < services.size(); idx++) {
+    delete services[idx];
   }
+  return 0;
 }
@@ -9,6 +9,7 @@
 class DistributedFileSystemService : public HttpService {
  public:
   DistributedFileSystemService(std::string driveFile);
+  ~DistributedFileSystemService();
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
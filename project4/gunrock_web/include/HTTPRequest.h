@@ -4,39 +4,104 @@
 #include "MySocket.h"
 #include "http_parser.h"
 #include "HTTP.h"
+#include "Arena.h"
 
 #include "WwwFormEncodedDict.h"
 #include "StringUtils.h"
 
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
+/**
+ * How long a client gets for each part of a request, in milliseconds,
+ * and how large the parts may be. Each deadline starts when the part
+ * before it ends, so trickling in a byte at a time doesn't buy a slow
+ * client more time. Negative timeouts wait forever.
+ */
+struct RequestLimits {
+  int idleTimeoutMs;     // connection accepted until the first byte
+  int headerTimeoutMs;   // first byte until the end of the headers
+  int bodyTimeoutMs;     // end of the headers until the end of the body
+  size_t maxHeaderBytes;
+  size_t maxBodyBytes;
+};
+
 class HTTPRequest {
 public:
-  HTTPRequest(MySocket *sock, int serverPort);
+  // shared by every request, set once at startup
+  static RequestLimits limits;
+
+  /**
+   * `arena`, if given, backs all of the request's parsing state; the
+   * request then has to be destroyed before the arena is reset, which
+   * Arena::create takes care of.
+   */
+  HTTPRequest(MySocket *sock, int serverPort, Arena *arena = NULL);
   ~HTTPRequest();
   
+  /**
+   * Reads the whole request within `limits`. Throws ClientError with
+   * 408, 413 or 431 when the client breaks them, SocketTimeout if it
+   * never sends anything, and the socket's read errors otherwise.
+   */
   bool readRequest();
 
   std::string getHost();
   std::string getRequest();
   std::string getUrl();
   std::string getPath();
+  std::string_view getPathView() {return m_http.getPathView();}
   std::vector<std::string> getPathComponents();
   std::string getHeader(std::string key);
+
+  /**
+   * Case-insensitive header lookup that doesn't copy or throw. On
+   * success `value` points into the request's receive buffer and
+   * stays valid as long as the request does.
+   */
+  bool findHeader(std::string_view key, std::string_view *value);
   bool hasAuthToken();
   std::string getAuthToken();
+  // the same without copying; false if there's no token
+  bool getAuthToken(std::string_view *token) {return m_http.getAuthToken(token);}
   bool isConnect();
-  bool isGet() {return m_http->isGet();}
-  bool isHead() {return m_http->isHead();}
-  bool isPut() {return m_http->isPut();}
-  bool isPost() {return m_http->isPost();}
-  bool isDelete() {return m_http->isDelete();}
-  bool isMove() {return m_http->isMove();}
+  http_method getMethod() {return m_http.getMethod();}
+  bool isGet() {return m_http.isGet();}
+  bool isHead() {return m_http.isHead();}
+  bool isPut() {return m_http.isPut();}
+  bool isPost() {return m_http.isPost();}
+  bool isDelete() {return m_http.isDelete();}
+  bool isMove() {return m_http.isMove();}
+  // query parameters as decoded views, in the order they were sent
+  typedef ArenaVector<std::pair<std::string_view, std::string_view> > Params;
+
+  /**
+   * The query string's parameters, repeated keys and all. It's decoded
+   * on first use and kept for the rest of the request, which the views
+   * are good for. Never throws: a parameter without '=' has an empty
+   * value, and a '%' that doesn't start an escape is kept as is.
+   */
+  const Params &getParamPairs();
+  // the first value of `key`; false if it wasn't sent
+  bool findParam(std::string_view key, std::string_view *value);
+  // one value per key, the last one sent
   std::map<std::string, std::string> getParams();
   WwwFormEncodedDict formEncodedBody();
-  std::string getBody() {return m_http->getBody();}
+  /**
+   * Decodes a form encoded body in place, in the receive buffer, and
+   * adds views of its keys and values to `pairs`; they're good for as
+   * long as the request is. Returns false if the body isn't form
+   * encoded. The body is overwritten either way.
+   */
+  bool formEncodedPairs(WwwFormEncodedDict::Pairs *pairs);
+  std::string getBody() {return m_http.getBody();}
+  // the body where it was received, without copying it; valid as long
+  // as the request is
+  std::string_view getBodyView() {return m_http.getBodyView();}
+  // the same, NUL terminated and writable, for parsing in place
+  char *getBodyInsitu() {return m_http.getBodyInsitu();}
   
   void printDebugInfo();
     
@@ -44,7 +109,11 @@ public:
     void onRead(const char *buffer, unsigned int len);
 
     MySocket *m_sock;
-    HTTP *m_http;
+    HTTP m_http;
+    // filled in by getParamPairs(); the views point into m_decodedQuery
+    bool m_paramsParsed;
+    ArenaString m_decodedQuery;
+    Params m_params;
     int m_serverPort;
     unsigned long m_totalBytesRead;
     unsigned long m_totalBytesWritten;
@@ -1,8 +1,11 @@
 #ifndef HTTP_RESPONSE_H_
 #define HTTP_RESPONSE_H_
 
-#include <map>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "MySocket.h"
 
 class HTTPResponse {
  public:
@@ -15,13 +18,30 @@ class HTTPResponse {
   int getStatus();
   std::string response();
 
+  /**
+   * Writes the status line and headers, including the terminating
+   * blank line, into `out`. `out` is cleared first so callers can
+   * hand in the same buffer for every response and keep its capacity.
+   */
+  void serializeHeaders(std::string *out);
+
+  /**
+   * Sends the whole response to `client`. The headers are serialized
+   * into a per-thread buffer and the body goes out as a separate
+   * iovec in the same writev call, so it is never copied.
+   */
+  void send(MySocket *client);
+
  private:
-  std::string statusToString();
+  const char *statusToString();
 
   int status;
   bool streaming;
-  std::map<std::string, std::string> headers;
+  // headers set by the service; Content-Type, Content-Length,
+  // Transfer-Encoding and Server are written by serializeHeaders
+  std::vector<std::pair<std::string, std::string> > headers;
   std::string body;
+  // empty means the default html content type
   std::string contentType;
 };
 
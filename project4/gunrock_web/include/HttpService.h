@@ -11,6 +11,7 @@
 class HttpService {
  public:
   HttpService(std::string pathPrefix);
+  virtual ~HttpService() {}
   std::string pathPrefix();
   
   virtual void head(HTTPRequest *request, HTTPResponse *response);
@@ -16,12 +16,21 @@ class MyServerSocket {
    */
   MyServerSocket(int port);
   MyServerSocket() { serverFd = -1; }
+
+  /**
+   * wraps a socket that is already bound and listening, such as one
+   * inherited from the process we're replacing
+   */
+  static MyServerSocket *fromFd(int fd);
   
   /**
    * this function will accept incoming requests to connect and
-   * return the resulting socket
+   * return the resulting socket. If `wakeFd` becomes readable while
+   * we're waiting it gives up and returns NULL instead.
    */
-  MySocket *accept();
+  MySocket *accept(int wakeFd = -1);
+
+  void close();
 
   int getFd() { return serverFd; }
  protected:
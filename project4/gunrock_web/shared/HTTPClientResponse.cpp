@@ -1,52 +1,143 @@
 #include "HTTPClientResponse.h"
+#include "StringUtils.h"
 
 #include <iostream>
 #include <string>
 
 #include <assert.h>
 #include <errno.h>
-
-#include <sstream>
+#include <string.h>
 
 using namespace std;
 
-HTTPClientResponse::HTTPClientResponse(MySocket *sock) {
+#define READ_SIZE 4096
+
+HTTPClientResponse::HTTPClientResponse(MySocket *sock, string *buffer, bool headRequest) {
     m_sock = sock;
+    m_buffer = buffer != NULL ? buffer : &m_own_buffer;
+    m_head_request = headRequest;
+    m_keep_alive = false;
+    m_started = false;
+    m_done = false;
+    m_in_value = false;
     m_status_code = 0;
+
+    memset(&m_settings, 0, sizeof(m_settings));
+    m_settings.on_header_field = header_field_cb;
+    m_settings.on_header_value = header_value_cb;
+    m_settings.on_headers_complete = headers_complete_cb;
+    m_settings.on_body = body_cb;
+    m_settings.on_message_complete = message_complete_cb;
+
+    http_parser_init(&m_parser, HTTP_RESPONSE);
+    m_parser.data = this;
 }
 
+string HTTPClientResponse::header(string name) {
+  name = StringUtils::toLower(name);
+  map<string, string>::iterator iter = m_headers.find(name);
+  if (iter == m_headers.end()) {
+    return "";
+  }
+  return iter->second;
+}
 
-string HTTPClientResponse::readResponse() {
-  string full_response;
+int HTTPClientResponse::header_field_cb(http_parser *parser, const char *at, size_t length) {
+  HTTPClientResponse *response = (HTTPClientResponse *) parser->data;
+  if (response->m_in_value) {
+    response->m_headers[StringUtils::toLower(response->m_field)] = response->m_value;
+    response->m_field.clear();
+    response->m_value.clear();
+    response->m_in_value = false;
+  }
+  response->m_field.append(at, length);
+  return 0;
+}
 
-  while (true) {
-    string response;
-    try {
-      response = m_sock->read();
-    } catch (...) {
-      break;
-    }
+int HTTPClientResponse::header_value_cb(http_parser *parser, const char *at, size_t length) {
+  HTTPClientResponse *response = (HTTPClientResponse *) parser->data;
+  response->m_value.append(at, length);
+  response->m_in_value = true;
+  return 0;
+}
 
-    full_response += response;
+int HTTPClientResponse::headers_complete_cb(http_parser *parser) {
+  HTTPClientResponse *response = (HTTPClientResponse *) parser->data;
+  if (response->m_in_value) {
+    response->m_headers[StringUtils::toLower(response->m_field)] = response->m_value;
+    response->m_in_value = false;
   }
+  response->m_status_code = parser->status_code;
+  response->m_keep_alive = http_should_keep_alive(parser);
 
-  size_t delimiter = full_response.find("\r\n\r\n");
-  if (delimiter == string::npos) {
-    return "";
+  int status = parser->status_code;
+  if (response->m_head_request || status / 100 == 1 || status == 204 || status == 304) {
+    // never has a body, whatever the headers say
+    return 1;
   }
+  return 0;
+}
 
-  m_body = full_response.substr(delimiter+4);
-  string header_string = full_response.substr(0, delimiter);
-  stringstream header_stream(header_string);
+int HTTPClientResponse::body_cb(http_parser *parser, const char *at, size_t length) {
+  HTTPClientResponse *response = (HTTPClientResponse *) parser->data;
+  if (response->m_sink) {
+    response->m_sink(at, length);
+  } else {
+    response->m_body.append(at, length);
+  }
+  return 0;
+}
+
+int HTTPClientResponse::message_complete_cb(http_parser *parser) {
+  HTTPClientResponse *response = (HTTPClientResponse *) parser->data;
+  response->m_done = true;
+  // stop the parser here, anything after this belongs to the next
+  // response
+  return -1;
+}
+
+// appends whatever the socket has to the buffer, false once it's closed
+bool HTTPClientResponse::readMore() {
+  size_t used = m_buffer->size();
+  m_buffer->resize(used + READ_SIZE);
+  int len;
+  try {
+    len = m_sock->read_bytes(&(*m_buffer)[used], READ_SIZE);
+  } catch (SocketReadError &) {
+    m_buffer->resize(used);
+    return false;
+  }
+
+  m_buffer->resize(used + len);
+  m_started = true;
+  return true;
+}
+
+string HTTPClientResponse::readResponse() {
+  m_started = !m_buffer->empty();
 
-  string line;
-  while (getline(header_stream, line)) {
-    if (line.find("HTTP/1.1 ") == 0 || line.find("HTTP/1.0") == 0) {
-      stringstream header_line(line);
-      string http;
-      header_line >> http >> m_status_code >> m_status_message;
+  while (!m_done) {
+    if (m_buffer->empty() && !readMore()) {
+      // tells the parser the connection closed, which ends a body that
+      // runs until then
+      http_parser_execute(&m_parser, &m_settings, NULL, 0);
+      if (!m_done) {
+        throw SocketReadError();
+      }
+      break;
     }
+
+    size_t parsed = http_parser_execute(&m_parser, &m_settings, m_buffer->data(), m_buffer->size());
+    if (m_done) {
+      // the parser stops on the last byte of the message
+      parsed++;
+    } else if (parsed != m_buffer->size()) {
+      throw SocketReadError();
+    }
+    // the parser keeps its own state, so only bytes past the end of
+    // this response need to stay
+    m_buffer->erase(0, parsed);
   }
-  
+
   return m_body;
 }
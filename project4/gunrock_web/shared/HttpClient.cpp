@@ -6,28 +6,82 @@
 #include "Base64.h"
 
 #include <sstream>
+#include <stdexcept>
 
 using namespace std;
 
 HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls) {
-  if (use_tls) {
-    //connection = new MySslSocket(inet_addr, port);
-    cerr << "Removed SSL sockets for now" << endl;
-    exit(1);
-  } else {
-    connection = new MySocket(inet_addr, port);
-  }
+  m_host = inet_addr;
+  m_port = port;
+  m_use_tls = use_tls;
+  m_keep_alive = true;
+  m_max_idle = 4;
+  m_current = NULL;
+
+  // connect right away so a bad address still fails here
+  m_idle.push_back(connect());
   
   stringstream host;
   host << inet_addr << ":" << port;
   headers["Host"] = host.str();
   headers["User-Agent"] = string("Gunrock/1.0");
   headers["Accept"] = string("*/*");
-  headers["Connection"] = string("close");
+  headers["Connection"] = string("keep-alive");
 }
 
 HttpClient::~HttpClient() {
-  delete connection;
+  if (m_current != NULL) {
+    release(m_current, false);
+  }
+  while (!m_idle.empty()) {
+    release(m_idle.back(), false);
+    m_idle.pop_back();
+  }
+}
+
+HttpClient::Connection *HttpClient::connect() {
+  MySocket *sock;
+  if (m_use_tls) {
+    //sock = new MySslSocket(m_host.c_str(), m_port);
+    cerr << "Removed SSL sockets for now" << endl;
+    exit(1);
+  } else {
+    sock = new MySocket(m_host.c_str(), m_port);
+  }
+
+  Connection *conn = new Connection();
+  conn->sock = sock;
+  conn->answered = 0;
+  return conn;
+}
+
+HttpClient::Connection *HttpClient::checkout() {
+  if (m_idle.empty()) {
+    return connect();
+  }
+  Connection *conn = m_idle.back();
+  m_idle.pop_back();
+  return conn;
+}
+
+void HttpClient::release(Connection *conn, bool reusable) {
+  if (reusable && m_keep_alive && m_idle.size() < m_max_idle) {
+    m_idle.push_back(conn);
+    return;
+  }
+  delete conn->sock;
+  delete conn;
+}
+
+void HttpClient::set_keep_alive(bool keep_alive, size_t max_idle) {
+  m_keep_alive = keep_alive;
+  m_max_idle = max_idle;
+  headers["Connection"] = keep_alive ? "keep-alive" : "close";
+
+  while (m_idle.size() > (keep_alive ? max_idle : 0)) {
+    release(m_idle.back(), false);
+    m_idle.pop_back();
+  }
 }
 
 void HttpClient::set_header(string key, string value) {
@@ -41,6 +95,23 @@ void HttpClient::set_basic_auth(string username, string password) {
   set_header("Authorization", value);
 }
 
+void HttpClient::send_pending() {
+  deque<PendingRequest>::iterator iter;
+  for (iter = m_pending.begin(); iter != m_pending.end(); iter++) {
+    m_current->sock->write(iter->data);
+  }
+}
+
+bool HttpClient::can_resend() {
+  deque<PendingRequest>::iterator iter;
+  for (iter = m_pending.begin(); iter != m_pending.end(); iter++) {
+    if (iter->method != "GET" && iter->method != "HEAD" && iter->method != "OPTIONS") {
+      return false;
+    }
+  }
+  return true;
+}
+
 void HttpClient::write_request(string path, string method, string body) {
   stringstream request;
 
@@ -64,15 +135,82 @@ void HttpClient::write_request(string path, string method, string body) {
   if (body.size() > 0) {
     request << body;
   }
-  
-  connection->write(request.str());
+
+  if (m_current == NULL) {
+    m_current = checkout();
+  }
+  m_pending.push_back({method, request.str()});
+
+  try {
+    m_current->sock->write(m_pending.back().data);
+  } catch (SocketWriteError &) {
+    if (m_current->answered == 0) {
+      // a brand new connection failing is a real error
+      release(m_current, false);
+      m_current = NULL;
+      m_pending.clear();
+      throw;
+    }
+    // the server closed the connection while it sat idle, maybe after
+    // reading some of what was already pipelined on it
+    release(m_current, false);
+    m_current = NULL;
+    if (!can_resend()) {
+      m_pending.clear();
+      throw;
+    }
+    m_current = connect();
+    send_pending();
+  }
 }
 
+HTTPClientResponse *HttpClient::read_response(HTTPClientResponse::BodySink sink) {
+  if (m_current == NULL || m_pending.empty()) {
+    throw logic_error("read_response without a request");
+  }
+
+  HTTPClientResponse *response = new HTTPClientResponse(m_current->sock, &m_current->buffer,
+							m_pending.front().method == "HEAD");
+  response->setBodySink(sink);
+  try {
+    response->readResponse();
+  } catch (SocketTimeout &) {
+    // the server is slow rather than gone, and may still act on what
+    // we sent
+    delete response;
+    release(m_current, false);
+    m_current = NULL;
+    m_pending.clear();
+    throw;
+  } catch (...) {
+    bool stale = m_current->answered > 0 && !response->started() && can_resend();
+    delete response;
+    release(m_current, false);
+    m_current = NULL;
+    if (!stale) {
+      m_pending.clear();
+      throw;
+    }
+
+    // the server closed a kept alive connection before it saw our
+    // requests, so try them again on a new one
+    m_current = connect();
+    send_pending();
+    return read_response(sink);
+  }
 
+  m_pending.pop_front();
+  m_current->answered++;
+  if (m_pending.empty()) {
+    release(m_current, response->keepAlive());
+    m_current = NULL;
+  } else if (!response->keepAlive()) {
+    // the server won't answer the rest on this connection
+    release(m_current, false);
+    m_current = connect();
+    send_pending();
+  }
 
-HTTPClientResponse *HttpClient::read_response() {
-  HTTPClientResponse *response = new HTTPClientResponse(connection);
-  response->readResponse();
   return response;
 }
 
@@ -1,5 +1,10 @@
 #include "MySslSocket.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
 #include <iostream>
 #include <sstream>
 
@@ -31,6 +36,9 @@ MySslSocket::MySslSocket(const char *inetAddr, int port, bool debug_print_io) {
   this->debug_print_io = debug_print_io;
   ctx = NULL;
   ssl = NULL;
+  ownsCtx = true;
+  handshakeState = 1;
+  ktlsSend = false;
   int res;
   
   const SSL_METHOD* method = TLS_client_method();
@@ -49,21 +57,156 @@ MySslSocket::MySslSocket(const char *inetAddr, int port, bool debug_print_io) {
   if (res != 1) handleFailure();
 }
 
-void MySslSocket::write(string buffer) {
-  const unsigned char *buf = (const unsigned char *) buffer.c_str();
-  unsigned int len = buffer.size();
-  int bytesWritten = 0;
+MySslSocket::MySslSocket(int socketFileDesc, SSL_CTX *ctx) : MySocket(socketFileDesc) {
+  debug_print_io = false;
+  this->ctx = ctx;
+  ownsCtx = false;
+  handshakeState = 0;
+  ktlsSend = false;
 
-  if (sockFd<0 || ssl==NULL) {
+  ssl = SSL_new(ctx);
+  if (ssl == NULL) handleFailure();
+  SSL_set_fd(ssl, sockFd);
+}
+
+MySslSocket::~MySslSocket() {
+  close();
+}
+
+SSL_CTX *MySslSocket::newServerContext(string certFile, string keyFile) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) handleFailure();
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    throw SocketError("can't load certificate " + certFile + " and key " + keyFile);
+  }
+
+  // TLS 1.2 clients resume from the cache, TLS 1.3 clients with
+  // tickets; OpenSSL makes the ticket keys, so tickets are good for as
+  // long as this context lives
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, 20 * 1024);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "gunrock", 7);
+  SSL_CTX_set_num_tickets(ctx, 2);
+
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  return ctx;
+}
+
+void MySslSocket::handshake() {
+  if (handshakeState > 0) {
+    return;
+  }
+  if (handshakeState < 0 || sockFd < 0 || ssl == NULL) {
     throw SocketNotConnected();
   }
 
+  // non-blocking, so waiting for the client is a poll with what's left
+  // of the read timeout, which covers the handshake as a whole rather
+  // than each step of it
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t deadlineMs = now.tv_sec * (int64_t) 1000 + now.tv_nsec / 1000000 + readTimeoutMs;
+  int flags = fcntl(sockFd, F_GETFL);
+  fcntl(sockFd, F_SETFL, flags | O_NONBLOCK);
+  handshakeState = -1;
+  try {
+    while (true) {
+      int res = SSL_accept(ssl);
+      if (res == 1) {
+        handshakeState = 1;
+        break;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = sockFd;
+      pfd.revents = 0;
+      int err = SSL_get_error(ssl, res);
+      if (err == SSL_ERROR_WANT_READ) {
+        pfd.events = POLLIN;
+      } else if (err == SSL_ERROR_WANT_WRITE) {
+        pfd.events = POLLOUT;
+      } else {
+        // not TLS, or not a version we speak
+        ERR_clear_error();
+        break;
+      }
+
+      int ret;
+      do {
+        int waitMs = -1;
+        if (readTimeoutMs >= 0) {
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          waitMs = max(deadlineMs - (now.tv_sec * (int64_t) 1000 + now.tv_nsec / 1000000), (int64_t) 0);
+        }
+        ret = poll(&pfd, 1, waitMs);
+      } while (ret < 0 && errno == EINTR);
+      if (ret == 0) {
+        throw SocketTimeout();
+      }
+      // errors and hangups show up on the next SSL_accept
+    }
+  } catch (...) {
+    fcntl(sockFd, F_SETFL, flags);
+    throw;
+  }
+  fcntl(sockFd, F_SETFL, flags);
+
+  if (handshakeState < 0) {
+    throw SocketReadError();
+  }
+#ifdef SSL_OP_ENABLE_KTLS
+  ktlsSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif
+}
+
+void MySslSocket::write(string buffer) {
   if (debug_print_io) {
     cout << "MySslSocket::write" << endl;
     cout << "------------------" << endl;
     cout << buffer << endl << endl;
   }
 
+  ssl_write_bytes(buffer.c_str(), buffer.size());
+}
+
+void MySslSocket::writev(const struct iovec *iov, int iovcnt) {
+  handshake();
+  if (ktlsSend && !debug_print_io) {
+    // the kernel builds the records, so the buffers can go out in one
+    // system call like on a plain socket
+    MySocket::writev(iov, iovcnt);
+    return;
+  }
+
+  // TLS records are built by OpenSSL, so there is no writev to hand
+  // the buffers to; write them back to back instead
+  for (int idx = 0; idx < iovcnt; idx++) {
+    if (debug_print_io) {
+      cout << "MySslSocket::writev" << endl;
+      cout << "-------------------" << endl;
+      cout << string((const char *) iov[idx].iov_base, iov[idx].iov_len) << endl << endl;
+    }
+    ssl_write_bytes(iov[idx].iov_base, iov[idx].iov_len);
+  }
+}
+
+void MySslSocket::ssl_write_bytes(const void *buffer, int len) {
+  const unsigned char *buf = (const unsigned char *) buffer;
+  int bytesWritten = 0;
+
+  if (sockFd<0 || ssl==NULL) {
+    throw SocketNotConnected();
+  }
+  handshake();
+
   while(len > 0) {
     bytesWritten = SSL_write(ssl, buf, len);
     if(bytesWritten <= 0) {
@@ -76,34 +219,52 @@ void MySslSocket::write(string buffer) {
 
 string MySslSocket::read() {
   char buffer[4096];
+  int ret = read_bytes(buffer, sizeof(buffer));
+  string result = string(buffer, ret);
+  
+  if (debug_print_io) {
+    cout << "MySslSocket::read" << endl;
+    cout << "-----------------" << endl;
+    cout << result << endl << endl;
+  }
+  
+  return result;
+}
+
+int MySslSocket::read_bytes(void *buffer, int len) {
   if(sockFd<0 || ssl == NULL) {
     throw SocketNotConnected();
   }
+  handshake();
     
-  int ret = SSL_read(ssl, buffer, sizeof(buffer));
+  // bytes OpenSSL already decrypted don't show up on the socket
+  if(SSL_pending(ssl) == 0) {
+    wait_readable();
+  }
+  int ret = SSL_read(ssl, buffer, len);
   
   if(ret <= 0) {
     throw SocketReadError();
   }
 
-  string result = string(buffer, ret);
-  
-  if (debug_print_io) {
-    cout << "MySslSocket::read" << endl;
-    cout << "-----------------" << endl;
-    cout << result << endl << endl;
+  return ret;
+}
+
+void MySslSocket::drain() {
+  // tell the peer we're done the TLS way before the TCP way
+  if (ssl != NULL && handshakeState > 0) {
+    SSL_shutdown(ssl);
   }
-  
-  return result;
+  MySocket::drain();
 }
 
 void MySslSocket::close() {
-  if(NULL != ctx)
-    SSL_CTX_free(ctx);
-
   if (NULL != ssl)
     SSL_free(ssl);
 
+  if(NULL != ctx && ownsCtx)
+    SSL_CTX_free(ctx);
+
   MySocket::close();
   
   ctx = NULL;
@@ -1,5 +1,6 @@
 #include "StringUtils.h"
 
+#include <ctype.h>
 
 using namespace std;
 
@@ -45,3 +46,10 @@ vector<string> StringUtils::split(string str, char delimiter) {
 
   return result;
 }
+
+string StringUtils::toLower(string str) {
+  for (size_t idx = 0; idx < str.size(); idx++) {
+    str[idx] = tolower((unsigned char) str[idx]);
+  }
+  return str;
+}
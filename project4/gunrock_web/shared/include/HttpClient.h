@@ -1,8 +1,10 @@
 #ifndef __HTTP_CLIENT_H__
 #define __HTTP_CLIENT_H__
 
+#include <deque>
 #include <string>
 #include <map>
+#include <vector>
 
 #include "HTTPClientResponse.h"
 #include "MySocket.h"
@@ -19,6 +21,9 @@ class HttpClient {
    *
    * Note: this call will block while establishing a connection.
    *
+   * Connections are kept alive and reused for later requests unless
+   * the server closes them; see set_keep_alive.
+   *
    * @param inetAddr either ip address, or the domain name
    * @param port the port to connect to
    */
@@ -93,12 +98,65 @@ class HttpClient {
    * @param value the value for the header with key
    */
   void set_header(std::string key, std::string value);
-  
+
+  /**
+   * Turns connection reuse on (the default) or off. With it off every
+   * request asks for Connection: close and gets a fresh connection.
+   *
+   * @param keep_alive whether to keep connections open between requests
+   * @param max_idle how many idle connections to hold on to
+   */
+  void set_keep_alive(bool keep_alive, size_t max_idle = 4);
+
+  /**
+   * Pipelining
+   *
+   * write_request can be called several times before read_response;
+   * the requests go out back to back on one connection and
+   * read_response returns their responses in the same order. If a
+   * reused connection turns out to have been closed by the server
+   * before it answered, the outstanding requests are sent again on a
+   * new connection, but only when they are all GET, HEAD or OPTIONS,
+   * and never after a timeout, since the server may have acted on
+   * them already.
+   *
+   * With a `sink` the body is streamed to it as it arrives instead of
+   * being kept in the response, see HTTPClientResponse::setBodySink.
+   */
   void write_request(std::string path, std::string method, std::string body);
-  HTTPClientResponse *read_response();
+  HTTPClientResponse *read_response(HTTPClientResponse::BodySink sink = NULL);
   
  private:
-  MySocket *connection;
+  struct Connection {
+    MySocket *sock;
+    // bytes read past the end of the last response
+    std::string buffer;
+    // requests on this connection that have been answered
+    int answered;
+  };
+
+  struct PendingRequest {
+    std::string method;
+    std::string data;
+  };
+
+  Connection *connect();
+  Connection *checkout();
+  void release(Connection *conn, bool reusable);
+  void send_pending();
+  // whether every pending request can safely reach the server twice
+  bool can_resend();
+
+  std::string m_host;
+  int m_port;
+  bool m_use_tls;
+  bool m_keep_alive;
+  size_t m_max_idle;
+  // the connection requests are being pipelined on, if any
+  Connection *m_current;
+  std::vector<Connection *> m_idle;
+  // requests written to m_current but not read back yet
+  std::deque<PendingRequest> m_pending;
   std::map<std::string, std::string> headers;
 };
   
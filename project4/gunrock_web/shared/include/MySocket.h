@@ -4,6 +4,8 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/uio.h>
+
 class SocketNotConnected : public std::runtime_error {
  public:
   SocketNotConnected() : std::runtime_error("socket not connected") {}
@@ -19,6 +21,11 @@ class SocketReadError : public std::runtime_error {
   SocketReadError() : std::runtime_error("socket read error") {}
 };
 
+class SocketTimeout : public std::runtime_error {
+ public:
+  SocketTimeout() : std::runtime_error("socket timeout") {}
+};
+
 class SocketError : public std::runtime_error {
  public:
   SocketError(std::string err) : std::runtime_error("socket error: " + err) {}
@@ -50,13 +57,46 @@ class MySocket {
 
 
   virtual std::string read();
+
+  /*
+   * reads at most `len` bytes into `buffer` and returns how many
+   * arrived. Throws SocketReadError on EOF or error, like read().
+   */
+  virtual int read_bytes(void *buffer, int len);
   virtual void write(std::string data);
+
+  /*
+   * writes every buffer in `iov` to the socket, in order, with as
+   * few system calls as possible. Handles partial writes.
+   */
+  virtual void writev(const struct iovec *iov, int iovcnt);
   virtual void close(void);
+
+  /*
+   * makes read_bytes throw SocketTimeout if no data arrives within
+   * `ms` milliseconds. Negative waits forever, which is the default.
+   */
+  void setReadTimeout(int ms);
+
+  /*
+   * makes writes that can't make progress for `ms` milliseconds fail
+   * with SocketWriteError. Negative or zero waits forever.
+   */
+  void setWriteTimeout(int ms);
+
+  /*
+   * sends FIN and throws away anything the peer has already sent, so
+   * closing right after a response doesn't reset the connection
+   * before the peer reads it. Never blocks.
+   */
+  virtual void drain(void);
   
  protected:
   void call_connect(const char *inetAddr, int port);
   void write_bytes(const void *buffer, int len);
+  void wait_readable(void);
   int sockFd;
+  int readTimeoutMs;
 };
 
 #endif
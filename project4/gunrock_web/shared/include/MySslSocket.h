@@ -19,14 +19,45 @@ class MySslSocket: public MySocket {
    */
   MySslSocket(const char *inetAddr, int port, bool debug_print_io=false);
 
+  /**
+   * the server side of a connection a MyServerSocket accepted. `ctx`
+   * is shared by every connection, so sessions resumed on one worker
+   * work on all of them, and it is never freed here. The handshake
+   * happens on the first read or write, in the worker, under the
+   * read timeout, rather than in the thread that accepted.
+   */
+  MySslSocket(int socketFileDesc, SSL_CTX *ctx);
+  ~MySslSocket();
+
+  /**
+   * makes the context every server connection shares: the certificate
+   * chain and key in PEM files, TLS 1.2 and up, resumption through a
+   * session cache (TLS 1.2) and tickets (TLS 1.3), and kernel TLS
+   * where the kernel and OpenSSL support it. Throws SocketError if the
+   * files don't load.
+   */
+  static SSL_CTX *newServerContext(std::string certFile, std::string keyFile);
+
   std::string read();
+  int read_bytes(void *buffer, int len);
   void write(std::string data);
+  void writev(const struct iovec *iov, int iovcnt);
+  void drain(void);
   void close(void);
   
  protected:
+  void ssl_write_bytes(const void *buffer, int len);
+  void handshake();
+
   SSL_CTX *ctx;
   SSL *ssl;
   bool debug_print_io;
+  // server connections share the context and don't free it
+  bool ownsCtx;
+  // 0 before the server side handshake, 1 after, -1 if it failed
+  int handshakeState;
+  // the kernel encrypts what we write, so plain writev works
+  bool ktlsSend;
 };
 
 #endif
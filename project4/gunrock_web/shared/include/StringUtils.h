@@ -8,6 +8,7 @@ class StringUtils {
  public:
   static std::vector<std::string> splitWithDelimiter(std::string str, char delimiter);
   static std::vector<std::string> split(std::string str, char delimiter);
+  static std::string toLower(std::string str);
   static std::string createAuthToken();
   static std::string createUserId();
 };